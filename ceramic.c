@@ -7,22 +7,59 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* Defines */
 
 #define CERAMIC_VERSION "0.0.1"
 #define CERAMIC_TAB_STOP 8
 #define CERAMIC_QUIT_TIMES 2
+#define CERAMIC_WATCH_INTERVAL 1
+#define CERAMIC_STREAM_CHUNK 65536
+#define CERAMIC_STREAM_READS 16
+#define CERAMIC_STREAM_REDRAW_MS 50
+#define CERAMIC_FILTER_IOV 1024
+#define CERAMIC_KILL_WAIT_MS 500
+#define CERAMIC_MACRO_DEPTH 8
+#ifndef CERAMIC_INDEX_MIN_SIZE
+#define CERAMIC_INDEX_MIN_SIZE (64L << 20)
+#endif
+#define CERAMIC_INDEX_MAGIC "CERIDX2\n"
+#define CERAMIC_INDEX_STRIDE 1024
+#define CERAMIC_INDEX_SAMPLES 16
+#define CERAMIC_INDEX_SAMPLE_SIZE 4096
+#define CERAMIC_CSV_GAP 2
+#define CERAMIC_CSV_MAX_WIDTH 40
+#define CERAMIC_CSV_SAMPLE 1024
+#define CERAMIC_WORD_MIN 3
+#define CERAMIC_WORD_MAX 64
+#define CERAMIC_WORD_BUILD_MS 8
+#define CERAMIC_MAX_THREADS 16
+#define CERAMIC_PARALLEL_MIN_ROWS 65536
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -41,6 +78,19 @@ enum editorKey {
   DELETE_KEY
 };
 
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
 enum modes {
   NORMAL,
   INSERT,
@@ -48,6 +98,109 @@ enum modes {
   TEST
 };
 
+/* Doc: struct editorSyntax
+ ----------------------------------------------
+ * Highlighting rules for one filetype
+ *
+ * char **filematch:
+ *
+ * * NULL terminated list of filename
+ * *     extensions (starting with '.') or
+ * *     substrings selecting this filetype
+ *
+ * char **keywords:
+ *
+ * * NULL terminated list of keywords,
+ * *     those ending in '|' are types
+ *
+ ----------------------------------------------*/
+struct editorSyntax {
+  char *filetype;
+  char **filematch;
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+};
+
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", ".hpp", ".cc", NULL };
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case",
+  "default", "do", "goto", "sizeof", "const", "volatile", "extern",
+  "#include", "#define", "#ifdef", "#ifndef", "#endif", "#if", "#else",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "short|", "size_t|", "ssize_t|", "bool|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+  {
+    "c",
+    C_HL_extensions,
+    C_HL_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/* Doc: struct fold
+ ----------------------------------------------
+ * A collapsed range of rows
+ *
+ * * start is the row left on screen to stand
+ * *     for the fold, rows start+1 to end
+ * *     (inclusive) are hidden
+ * * folds in E.folds never overlap and are
+ * *     kept sorted by start
+ *
+ ----------------------------------------------*/
+struct fold {
+  int start;
+  int end;
+};
+
+/* Doc: struct editorCompression
+ ----------------------------------------------
+ * A compressed format editorOpen can read
+ *
+ * char *magic, int magiclen:
+ *
+ * * bytes the compressed file starts with
+ *
+ * char *decoders[][], char *encoders[][]:
+ *
+ * * argv of the programs to stream the file
+ * *     through, tried in order until one can
+ * *     be started, parallel ones first
+ *
+ ----------------------------------------------*/
+struct editorCompression {
+  char *name;
+  char *magic;
+  int magiclen;
+  char *decoders[3][4];
+  char *encoders[3][4];
+};
+
+struct editorCompression CDB[] = {
+  {
+    "gzip", "\x1f\x8b", 2,
+    {{"pigz", "-dc", NULL}, {"gzip", "-dc", NULL}},
+    {{"pigz", "-c", NULL}, {"gzip", "-c", NULL}}
+  },
+  {
+    "zstd", "\x28\xb5\x2f\xfd", 4,
+    {{"zstd", "-dcq", NULL}},
+    {{"zstd", "-cq", "-T0", NULL}}
+  },
+};
+
+#define CDB_ENTRIES (sizeof(CDB) / sizeof(CDB[0]))
+
 /* Doc: struct erow
  ----------------------------------------------
  * A single row in the open buffer
@@ -59,30 +212,172 @@ enum modes {
  *
  * int rsize:
  *
- * * the length of the row in character widths
- * * Tabs = 8 spaces, so 8 character widths
- * * * Insert all such examples here
+ * * the number of bytes in render
+ * * Tabs = 8 spaces, so up to 8 bytes
+ *
+ * int rwidth:
+ *
+ * * the width of render in screen columns
+ * * equal to rsize for ASCII rows; UTF-8
+ * *     sequences take one column, two for
+ * *     wide (CJK) characters and none for
+ * *     combining marks
+ *
+ * int ascii:
+ *
+ * * 1 when chars holds no byte >= 0x80, so
+ * *     bytes and columns line up and the
+ * *     UTF-8 paths can be skipped entirely
+ *
+ * int wraplines:
+ *
+ * * screen lines the row takes up in soft
+ * *     wrap mode, as counted in the wrap
+ * *     index; only meaningful while the index
+ * *     is valid
  *
  * char *chars:
  *
  * * character array, with length size+1
  * * 0 terminated
  * * contains all characters in row
+ * * reference counted (see editorBufAlloc),
+ * *     may be shared with registers and other
+ * *     rows, so it is copied before being
+ * *     written to
  *
  * char *render:
  *
  * * character array, with length rsize+1
  * * 0 terminated
  * * contains all characters to be rendered
+ * * reference counted like chars
+ *
+ * uint64_t hash:
+ *
+ * * FNV-1a hash of chars, refreshed by
+ * *     editorUpdateRow
+ * * used to diff the buffer against the file
+ * *     on disk when it changes externally
+ *
+ * unsigned char *hl:
+ *
+ * * highlight class (enum editorHighlight) of
+ * *     each character in render, length rsize
+ * * NULL until the row is drawn, and again
+ * *     whenever render changes
+ *
+ * int hl_open:
+ *
+ * * lexer state at the end of the row, 1 when
+ * *     it ends inside a multi-line comment
+ * * -1 when the row has never been lexed
+ * * kept across edits so re-lexing can stop as
+ * *     soon as the state comes out the same
  *
  ----------------------------------------------*/
 typedef struct erow {
   int size;
   int rsize;
+  int rwidth;
+  int ascii;
+  int wraplines;
   char *chars;
   char *render;
+  uint64_t hash;
+  unsigned char *hl;
+  int hl_open;
 } erow;
 
+/* Doc: struct editorRegister
+ ----------------------------------------------
+ * Rows yanked or deleted in VISUAL mode
+ *
+ * * rows are handles sharing chars and render
+ * *     with the buffer, nothing is copied
+ * * hl is always NULL, it is rebuilt when a
+ * *     put row is drawn
+ *
+ ----------------------------------------------*/
+struct editorRegister {
+  erow *rows;
+  int numrows;
+};
+
+/* Doc: struct editorMacro
+ ----------------------------------------------
+ * Keys recorded into a macro register
+ *
+ * * keys are as returned by editorReadKey, so
+ * *     escape sequences are stored as one key
+ *
+ ----------------------------------------------*/
+struct editorMacro {
+  int *keys;
+  int length;
+  int cap;
+};
+
+// A macro being played back, see editorReadKey
+struct editorReplay {
+  const int *keys;
+  int length;
+  int pos;
+};
+
+/* Doc: struct editorWordNode
+ ----------------------------------------------
+ * Node of the word index trie, nodes live in
+ *     E.widx and link to each other by index
+ *
+ * * children are a sibling list sorted by c,
+ * *     0 ends a list, since the root (node 0)
+ * *     is nobody's child
+ * * count is how many times the word ending
+ * *     here occurs in the indexed rows
+ * * words is how many distinct words end in
+ * *     this subtree, this node included, so
+ * *     words can be ranked and picked by rank
+ * *     without walking the whole subtree
+ *
+ ----------------------------------------------*/
+struct editorWordNode {
+  int child;
+  int sibling;
+  int count;
+  int words;
+  unsigned char c;
+};
+
+/* Doc: struct editorFilter
+ ----------------------------------------------
+ * An external command rows are being piped
+ *     through, see editorFilterStart
+ *
+ * * rows [at, at + count) are written to in
+ * *     straight from E.row, row and off say
+ * *     how far that got
+ * * output is parsed into rows, which replace
+ * *     the range in one splice at the end
+ *
+ ----------------------------------------------*/
+struct editorFilter {
+  pid_t pid;
+  int in;
+  int out;
+  int at;
+  int count;
+  int row;
+  int off;
+  erow *rows;
+  int numrows;
+  int rowcap;
+  char *line;
+  size_t linelen;
+  size_t linecap;
+  long drawn;
+};
+
 /* Doc: struct editorConfig
  ----------------------------------------------
  * Current configuration of an editor
@@ -98,11 +393,87 @@ typedef struct erow {
  * *     in terms of rendered characters (see
  * *     Doc: _______ for more info)
  *
+ * int vstart:
+ *
+ * * row the VISUAL selection was started on,
+ * *     the selection runs from there to cy
+ *
+ * struct editorRegister reg:
+ *
+ * * register for yank, delete and put
+ *
+ * int count:
+ *
+ * * repeat count typed so far in NORMAL mode,
+ * *     0 when none
+ *
+ * struct editorMacro macros[26]:
+ *
+ * * macro registers a-z
+ *
+ * int recording:
+ *
+ * * register being recorded into, 0 if none
+ *
+ * struct editorReplay replay[]:
+ *
+ * * stack of macros being played back, keys
+ * *     come from the top one while
+ * *     replay_depth > 0
+ * * nothing is drawn during playback
+ *
  * int rowoff, coloff:
  *
  * * row and coloumn offset in display from
  * *     beginning of file, used for scrolling
  *
+ * int wrap, wrapoff:
+ *
+ * * wrap is 1 in soft wrap mode, where long
+ * *     rows continue on the next screen line
+ * *     and coloff stays 0
+ * * wrapoff is the first screen line of row
+ * *     rowoff that is shown
+ *
+ * int csv:
+ *
+ * * field delimiter in the columnar view, 0
+ * *     when it's off
+ * * fields are drawn padded to csv_widths,
+ * *     measured from a sample of the first
+ * *     rows and from every row that gets
+ * *     drawn, so no pass over the whole file
+ * *     is needed. Editing starts the
+ * *     measuring over so columns can shrink
+ *
+ * struct fold *folds, int numfolds:
+ *
+ * * collapsed row ranges, sorted, so the fold
+ * *     around a row is a binary search away
+ *
+ * int *fold_hidden:
+ *
+ * * fold_hidden[k] is the number of rows
+ * *     hidden by folds[0] to folds[k-1], to
+ * *     count visible rows in O(log n)
+ *
+ * int *wrap_tree, wrap_clean:
+ *
+ * * Fenwick tree over the wraplines of every
+ * *     row, mapping between rows and screen
+ * *     lines in O(log n)
+ * * point updates keep it current on edits;
+ * *     adding or removing rows lowers
+ * *     wrap_clean to the first row that moved,
+ * *     and only the tree past it is rebuilt
+ * *     on next use
+ *
+ * int winch_fd[2], resized:
+ *
+ * * self-pipe and flag set by the SIGWINCH
+ * *     handler, so a resize wakes the poll in
+ * *     editorWaitForKey
+ *
  * int screenrows, screencols, numrows:
  *
  * * current total screen rows and columns,
@@ -111,7 +482,7 @@ typedef struct erow {
  * erow *row:
  *
  * * dynamically allocated array of rows in file
- * * size = numrows
+ * * size = numrows, capacity = rowcap
  *
  * int dirty:
  *
@@ -126,6 +497,84 @@ typedef struct erow {
  * * when NULL, editor works, but prompts for
  * *     filename on save
  *
+ * off_t file_size, struct timespec file_mtime:
+ *
+ * * size and modification time of the file as
+ * *     of the last open, save or reload
+ * * compared against stat() to notice when
+ * *     another process rewrites the file
+ *
+ * time_t file_checked:
+ *
+ * * last time the file was stat()ed, so the
+ * *     check runs at most once per
+ * *     CERAMIC_WATCH_INTERVAL seconds
+ *
+ * int file_changed:
+ *
+ * * set when the file changed on disk while
+ * *     the buffer had unsaved changes
+ *
+ * int prompting:
+ *
+ * * set while editorPrompt waits for input;
+ * *     commands that prompt have already
+ * *     picked their rows, so reloads wait
+ *
+ * struct editorSyntax *syntax:
+ *
+ * * highlighting rules for the open file, NULL
+ * *     when its filetype isn't known
+ *
+ * int hl_clean, hl_stale_end:
+ *
+ * * rows before hl_clean have an up to date
+ * *     hl_open
+ * * rows from hl_stale_end onwards were last
+ * *     lexed against the old hl_open of the
+ * *     row before them, so lexing can stop
+ * *     there once that state is reproduced
+ *
+ * struct editorCompression *compression:
+ *
+ * * format the open file was decompressed
+ * *     from, NULL for plain files
+ *
+ * int stream_fd:
+ *
+ * * descriptor rows are still being read from
+ * *     when the buffer was opened from a pipe,
+ * *     -1 otherwise
+ *
+ * pid_t stream_pid:
+ *
+ * * decoder writing into stream_fd, 0 if none
+ *
+ * char *stream_line:
+ *
+ * * partial last line read from stream_fd,
+ * *     waiting for its newline
+ *
+ * struct editorWordNode *widx:
+ *
+ * * trie of the words in rows [0, widx_built)
+ * * kept up to date as those rows change, the
+ * *     rest is indexed from editorIdle a few
+ * *     milliseconds at a time
+ *
+ * int comp_row, comp_start, comp_len:
+ *
+ * * word the last Ctrl-N completion put in,
+ * *     another Ctrl-N right after replaces it
+ * *     with the next match of comp_prefix
+ *
+ * struct editorFilter filter:
+ *
+ * * command the buffer is being filtered
+ * *     through, filter.pid is 0 if none
+ * * only cursor movement is allowed while
+ * *     it runs, ESC cancels it
+ *
  * char statusmsg[80]:
  *
  * * current status message, displayed on
@@ -149,9 +598,37 @@ struct editorConfig {
   int cx, cy;
   int rx;
 
+  int vstart;
+  struct editorRegister reg;
+
+  int count;
+  struct editorMacro macros[26];
+  int recording;
+  int last_macro;
+  struct editorReplay replay[CERAMIC_MACRO_DEPTH];
+  int replay_depth;
+
   int rowoff;
   int coloff;
 
+  struct fold *folds;
+  int numfolds;
+  int foldcap;
+  int *fold_hidden;
+
+  int wrap;
+  int wrapoff;
+  int *wrap_tree;
+  int wrap_treecap;
+  int wrap_clean;
+
+  int csv;
+  int *csv_widths;
+  int csv_numcols;
+  int csv_sampled;
+
+  int winch_fd[2];
+  volatile sig_atomic_t resized;
   int screenrows;
   int screencols;
   int numrows;
@@ -159,10 +636,44 @@ struct editorConfig {
   int r_mov;
 
   erow *row;
+  int rowcap;
 
   int dirty;
 
   char *filename;
+  off_t file_size;
+  struct timespec file_mtime;
+  time_t file_checked;
+  int file_changed;
+  int prompting;
+
+  struct editorSyntax *syntax;
+  int hl_clean;
+  int hl_stale_end;
+
+  struct editorCompression *compression;
+
+  int stream_fd;
+  pid_t stream_pid;
+  char *stream_line;
+  size_t stream_linelen;
+  size_t stream_linecap;
+  long stream_drawn;
+
+  struct editorWordNode *widx;
+  int widx_len;
+  int widx_cap;
+  int widx_built;
+
+  int comp_row;
+  int comp_start;
+  int comp_len;
+  int comp_dirty;
+  char comp_prefix[CERAMIC_WORD_MAX];
+  int comp_prefixlen;
+
+  struct editorFilter filter;
+
   char statusmsg[80];
   time_t statusmsg_time;
 
@@ -176,8 +687,22 @@ struct editorConfig E;
 void editorSetStatusMessage(const char *fmt, ...);
 void editorClearStatusMessage();
 void editorRefreshScreen();
+void editorRecordFileStat();
+void editorOpenStream(int fd);
 char *editorPrompt(char *prompt, void(*callback)(char *, int));
+char *editorPromptInput(char *prompt, void(*callback)(char *, int),
+    int empty);
+int editorConfirm(const char *prompt);
 int editorRowRxToCx(erow *row, int rx);
+void editorIdle();
+void editorWaitForKey();
+int editorReadTtyKey();
+void editorProcessKey(int c);
+void editorWrapInvalidate(int at);
+void editorWrapUpdateRow(int at);
+int editorWrapPrefix(int at);
+long editorNow();
+void editorRowReplace(erow *row, int i, int qlen, const char *s, int slen);
 
 /* Terminal sets */
 
@@ -213,12 +738,35 @@ void enableRawMode() {
 
 /* Read keys */
 
+/* Returns the next key, from the macro being played back if there is one,
+ * and adds it to the macro being recorded otherwise */
 int editorReadKey() {
+  if (E.replay_depth) {
+    struct editorReplay *r = &E.replay[E.replay_depth - 1];
+    // A macro that ends halfway through a prompt cancels it
+    return r->pos < r->length ? r->keys[r->pos++] : '\x1b';
+  }
+
+  int c = editorReadTtyKey();
+  if (E.recording) {
+    struct editorMacro *m = &E.macros[E.recording - 'a'];
+    if (m->length == m->cap) {
+      m->cap = m->cap ? m->cap * 2 : 64;
+      m->keys = realloc(m->keys, sizeof(int) * m->cap);
+    }
+    m->keys[m->length++] = c;
+  }
+  return c;
+}
+
+int editorReadTtyKey() {
   int nread;
-  char c;
+  unsigned char c;
+  editorWaitForKey();
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die ("read");
+    editorWaitForKey();
   }
 
   if (c == '\x1b') {
@@ -315,221 +863,3441 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/* row operations */
-
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (CERAMIC_TAB_STOP - 1) - (rx % CERAMIC_TAB_STOP);
-    rx++;
-  }
-  return rx;
+/* A resize only sets a flag and pokes the self-pipe, editorCheckResize
+ * does the work from the event loop */
+void editorHandleWinch(int sig) {
+  (void) sig;
+  int saved = errno;
+  E.resized = 1;
+  write(E.winch_fd[1], "", 1);
+  errno = saved;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (CERAMIC_TAB_STOP - 1) - (cur_rx % CERAMIC_TAB_STOP);
-    cur_rx++;
-
-    if (cur_rx > rx)
-      return cx;
-  }
-  return cx;
+void editorInstallWinch() {
+  if (pipe2(E.winch_fd, O_CLOEXEC | O_NONBLOCK) == -1)
+    die("pipe2");
+
+  // No SA_RESTART, so a blocked poll or read wakes up on a resize
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
 }
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for(j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
+/* Doc: editorCheckResize
+ ----------------------------------------------
+ * Picks up the new window size after one or
+ *     more SIGWINCHs and redraws once
+ *
+ * * every signal since the last check is
+ * *     drained from the self-pipe at once, so
+ * *     dragging a window redraws at most once
+ * *     per trip around the event loop
+ * * asks the kernel only, never the terminal:
+ * *     the cursor query would race with keys
+ * * nothing is redrawn if the size came back
+ * *     unchanged
+ *
+ ----------------------------------------------*/
+void editorCheckResize() {
+  if (!E.resized)
+    return;
+  E.resized = 0;
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(CERAMIC_TAB_STOP - 1) + 1);
+  char buf[64];
+  while (read(E.winch_fd[0], buf, sizeof(buf)) > 0)
+    ;
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % CERAMIC_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    }
-    else {
-      row->render[idx++] = row->chars[j];
-    }
-  }
-  row->render[idx] = '\0';
-    row->rsize = idx;
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    return;
+  int rows = ws.ws_row > 3 ? ws.ws_row - 2 : 1;
+  if (rows == E.screenrows && ws.ws_col == E.screencols)
+    return;
+
+  E.screenrows = rows;
+  E.screencols = ws.ws_col;
+  editorWrapInvalidate(0);
+  editorRefreshScreen();
 }
 
-void editorInsertRow (int i, char *s, size_t length) {
-  if (i < 0 || i > E.numrows)
-    return;
+/* Hashing */
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[i+1], &E.row[i], sizeof(erow) * (E.numrows - i));
+uint64_t editorHashBytes(const char *s, size_t length) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t j;
+  for (j = 0; j < length; j++) {
+    h ^= (unsigned char) s[j];
+    h *= 1099511628211ULL;
+  }
+  // Mix in the length so "" and "\0" don't collide
+  return h ^ length;
+}
 
-  E.row[i].size = length;
-  E.row[i].chars = malloc(length + 1);
-  memcpy(E.row[i].chars, s, length);
-  E.row[i].chars[length] = '\0';
+/* Shared row storage */
 
-  E.row[i].rsize= 0;
-  E.row[i].render = NULL;
-  editorUpdateRow(&E.row[i]);
+/* Row chars and render are allocated with a reference count in front, so
+ * registers and put rows can point at the same bytes as the buffer. The
+ * count is changed atomically since replace-all releases buffers from
+ * worker threads. */
+struct rowbuf {
+  int refs;
+  char data[];
+};
 
-  E.numrows++;
-  E.dirty++;
+struct rowbuf *editorBufHeader(char *p) {
+  return (struct rowbuf *) (p - offsetof(struct rowbuf, data));
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+char *editorBufAlloc(size_t size) {
+  struct rowbuf *b = malloc(sizeof(struct rowbuf) + size);
+  if (b == NULL)
+    die("malloc");
+  b->refs = 1;
+  return b->data;
 }
 
-void editorDeleteRow(int i) {
-  if (i < 0 || i >= E.numrows)
-    return;
-  editorFreeRow(&E.row[i]);
-  memmove(&E.row[i], &E.row[i+1], sizeof(erow) * (E.numrows - i - 1));
-  E.numrows--;
-  E.dirty++;
+char *editorBufRetain(char *p) {
+  if (p)
+    __atomic_add_fetch(&editorBufHeader(p)->refs, 1, __ATOMIC_RELAXED);
+  return p;
 }
 
-void editorRowInsertChar(erow *row, int i, int c) {
-  if (i < 0 || i > row->size)
-    i = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[i+1] ,&row->chars[i], row->size - i + 1);
-  row->size++;
-  row->chars[i] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+void editorBufRelease(char *p) {
+  if (p && __atomic_sub_fetch(&editorBufHeader(p)->refs, 1,
+        __ATOMIC_ACQ_REL) == 0)
+    free(editorBufHeader(p));
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  }
-  else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+/* Grows or shrinks p to size bytes, keeping its first keep bytes. A shared
+ * buffer is copied instead, so the other holders don't see the change. */
+char *editorBufResize(char *p, size_t keep, size_t size) {
+  struct rowbuf *b = editorBufHeader(p);
+  if (__atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1) {
+    b = realloc(b, sizeof(struct rowbuf) + size);
+    if (b == NULL)
+      die("realloc");
+    return b->data;
   }
-  E.cy++;
-  E.cx = 0;
+  char *copy = editorBufAlloc(size);
+  memcpy(copy, p, keep < size ? keep : size);
+  editorBufRelease(p);
+  return copy;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Makes row->chars safe to write to in place
+void editorRowMakeWritable(erow *row) {
+  row->chars = editorBufResize(row->chars, row->size + 1, row->size + 1);
 }
 
-void editorRowDeleteChar(erow *row, int i) {
-  if (i < 0 || i >= row->size)
-    return;
-  memmove(&row->chars[i], &row->chars[i+1], row->size - i);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+/* Syntax highlighting */
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-/* Editor Operations */
+/* Doc: editorSyntaxLex
+ ----------------------------------------------
+ * Lexes one row, starting in state in_comment
+ *
+ * * returns the state at the end of the row
+ * *     and stores it in hl_open
+ * * fills row->hl when hl is given, otherwise
+ * *     only the state is tracked, which is all
+ * *     rows above the screen need
+ *
+ ----------------------------------------------*/
+int editorSyntaxLex(erow *row, int in_comment, unsigned char *hl) {
+  struct editorSyntax *syntax = E.syntax;
+  char **keywords = syntax->keywords;
+
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  if (hl)
+    memset(hl, HL_NORMAL, row->rsize);
+
+  int prev_sep = 1;
+  int in_string = 0;
+
+  int i = 0;
+  while (i < row->rsize) {
+    char c = row->render[i];
+    unsigned char prev_hl = (hl && i > 0) ? hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment) {
+      if (!strncmp(&row->render[i], scs, scs_len)) {
+        if (hl)
+          memset(&hl[i], HL_COMMENT, row->rsize - i);
+        break;
+      }
+    }
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow (E.numrows, "", 0);
-  }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
-}
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        if (hl)
+          hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&row->render[i], mce, mce_len)) {
+          if (hl)
+            memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        }
+        i++;
+        continue;
+      }
+      else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+        if (hl)
+          memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
 
-void editorDeleteChar() {
-  if (E.cy == E.numrows || (E.cx == 0 && E.cy == 0)) {
-    return;
-  }
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDeleteChar(row, --(E.cx));
-  }
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        if (hl)
+          hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < row->rsize) {
+          if (hl)
+            hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == in_string)
+          in_string = 0;
+        i++;
+        prev_sep = 1;
+        continue;
+      }
+      else if (c == '"' || c == '\'') {
+        in_string = c;
+        if (hl)
+          hl[i] = HL_STRING;
+        i++;
+        continue;
+      }
+    }
+
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit((unsigned char) c) && (prev_sep || prev_hl == HL_NUMBER))
+          || (c == '.' && prev_hl == HL_NUMBER)) {
+        if (hl)
+          hl[i] = HL_NUMBER;
+        i++;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+          klen--;
+
+        if (!strncmp(&row->render[i], keywords[j], klen) &&
+            is_separator((unsigned char) row->render[i + klen])) {
+          if (hl)
+            memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (keywords[j] != NULL) {
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    prev_sep = is_separator((unsigned char) c);
+    i++;
+  }
+
+  row->hl_open = in_comment;
+  return in_comment;
+}
+
+// Lexes row at with attributes, for drawing
+void editorSyntaxHighlightRow(int at) {
+  erow *row = &E.row[at];
+  int in_comment = at > 0 ? E.row[at - 1].hl_open : 0;
+  free(row->hl);
+  row->hl = malloc(row->rsize ? row->rsize : 1);
+  editorSyntaxLex(row, in_comment, row->hl);
+}
+
+/* Doc: editorSyntaxUpdate
+ ----------------------------------------------
+ * Brings hl_open up to date for rows up to
+ *     and including upto
+ *
+ * * starts at hl_clean, the first row whose
+ * *     state may be off
+ * * stops early once a row past the edited
+ * *     rows ends in the state it had before,
+ * *     since nothing below can change then
+ * * rows in [vis_start, vis_end) get their
+ * *     attributes filled in on the way, all
+ * *     other rows only have their state
+ * *     tracked
+ *
+ ----------------------------------------------*/
+void editorSyntaxUpdate(int upto, int vis_start, int vis_end) {
+  if (E.syntax == NULL)
+    return;
+
+  while (E.hl_clean <= upto && E.hl_clean < E.numrows) {
+    int at = E.hl_clean;
+    erow *row = &E.row[at];
+    int old = row->hl_open;
+
+    if (at >= vis_start && at < vis_end) {
+      editorSyntaxHighlightRow(at);
+    }
+    else {
+      free(row->hl);
+      row->hl = NULL;
+      editorSyntaxLex(row, at > 0 ? E.row[at - 1].hl_open : 0, NULL);
+    }
+    E.hl_clean++;
+
+    if (at >= E.hl_stale_end - 1) {
+      if (old != -1 && old == row->hl_open) {
+        E.hl_clean = E.numrows;
+        break;
+      }
+      E.hl_stale_end = at + 2;
+    }
+  }
+
+  if (E.hl_clean >= E.numrows)
+    E.hl_stale_end = 0;
+}
+
+// The contents of rows [at, at + count) changed
+void editorSyntaxInvalidate(int at, int count) {
+  if (at < E.hl_clean)
+    E.hl_clean = at;
+  if (at + count > E.hl_stale_end)
+    E.hl_stale_end = at + count;
+}
+
+// Rows [at, at + delcount) were replaced by inscount new ones
+void editorSyntaxShift(int at, int delcount, int inscount) {
+  if (E.hl_stale_end > at + delcount)
+    E.hl_stale_end += inscount - delcount;
+  else if (E.hl_stale_end > at)
+    E.hl_stale_end = at;
+  // The row after the new ones has a new predecessor either way
+  editorSyntaxInvalidate(at, inscount + 1);
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    default: return 37;
+  }
+}
+
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+  E.hl_clean = 0;
+  E.hl_stale_end = E.numrows;
+  if (E.filename == NULL)
+    return;
+
+  char *ext = strrchr(E.filename, '.');
+
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    int i;
+    for (i = 0; s->filematch[i]; i++) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        E.syntax = s;
+        break;
+      }
+    }
+    if (E.syntax)
+      break;
+  }
+
+  // Attributes from the old rules are worthless
+  int i;
+  for (i = 0; i < E.numrows; i++) {
+    free(E.row[i].hl);
+    E.row[i].hl = NULL;
+    E.row[i].hl_open = -1;
+  }
+}
+
+/* UTF-8 */
+
+struct widthRange {
+  uint32_t first;
+  uint32_t last;
+  int width;
+};
+
+// Code points that aren't one column wide, sorted
+struct widthRange WIDTHS[] = {
+  {0x0300, 0x036f, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05bd, 0},
+  {0x0610, 0x061a, 0}, {0x064b, 0x065f, 0}, {0x0e31, 0x0e31, 0},
+  {0x0e34, 0x0e3a, 0}, {0x0e47, 0x0e4e, 0}, {0x1100, 0x115f, 2},
+  {0x1ab0, 0x1aff, 0}, {0x1dc0, 0x1dff, 0}, {0x200b, 0x200f, 0},
+  {0x20d0, 0x20ff, 0}, {0x231a, 0x231b, 2}, {0x2329, 0x232a, 2},
+  {0x23e9, 0x23ec, 2}, {0x25fd, 0x25fe, 2}, {0x2614, 0x2615, 2},
+  {0x2e80, 0x303e, 2}, {0x3041, 0x33ff, 2}, {0x3400, 0x4dbf, 2},
+  {0x4e00, 0x9fff, 2}, {0xa000, 0xa4cf, 2}, {0xa960, 0xa97f, 2},
+  {0xac00, 0xd7a3, 2}, {0xf900, 0xfaff, 2}, {0xfe00, 0xfe0f, 0},
+  {0xfe10, 0xfe19, 2}, {0xfe20, 0xfe2f, 0}, {0xfe30, 0xfe6f, 2},
+  {0xff00, 0xff60, 2}, {0xffe0, 0xffe6, 2}, {0x16fe0, 0x16fe4, 2},
+  {0x17000, 0x18cff, 2}, {0x1b000, 0x1b2ff, 2}, {0x1f300, 0x1f64f, 2},
+  {0x1f680, 0x1f6ff, 2}, {0x1f900, 0x1f9ff, 2}, {0x20000, 0x2fffd, 2},
+  {0x30000, 0x3fffd, 2}, {0xe0100, 0xe01ef, 0},
+};
+
+#define WIDTHS_ENTRIES (sizeof(WIDTHS) / sizeof(WIDTHS[0]))
+
+/* Width of each BMP code point, filled in once by editorInitWidths before
+ * any rows are rendered and only read after that, so render workers can
+ * share it */
+unsigned char width_cache[0x10000];
+
+void editorInitWidths() {
+  memset(width_cache, 1, sizeof(width_cache));
+  unsigned int i;
+  for (i = 0; i < WIDTHS_ENTRIES && WIDTHS[i].first < 0x10000; i++) {
+    uint32_t last = WIDTHS[i].last < 0x10000 ? WIDTHS[i].last : 0xffff;
+    memset(&width_cache[WIDTHS[i].first], WIDTHS[i].width,
+        last - WIDTHS[i].first + 1);
+  }
+}
+
+int editorCharWidth(uint32_t cp) {
+  if (cp < 0x10000)
+    return width_cache[cp];
+
+  int lo = 0, hi = WIDTHS_ENTRIES - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < WIDTHS[mid].first) {
+      hi = mid - 1;
+    }
+    else if (cp > WIDTHS[mid].last) {
+      lo = mid + 1;
+    }
+    else {
+      return WIDTHS[mid].width;
+    }
+  }
+  return 1;
+}
+
+/* Decodes the UTF-8 sequence at s, at most length bytes long. Returns its
+ * length in bytes; malformed input decodes as U+FFFD one byte at a time. */
+int editorUtf8Decode(const char *s, int length, uint32_t *cp) {
+  const unsigned char *u = (const unsigned char *) s;
+  int n;
+  uint32_t c;
+
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+  else if ((u[0] & 0xe0) == 0xc0) {
+    n = 2;
+    c = u[0] & 0x1f;
+  }
+  else if ((u[0] & 0xf0) == 0xe0) {
+    n = 3;
+    c = u[0] & 0x0f;
+  }
+  else if ((u[0] & 0xf8) == 0xf0) {
+    n = 4;
+    c = u[0] & 0x07;
+  }
+  else {
+    *cp = 0xfffd;
+    return 1;
+  }
+
+  if (n > length) {
+    *cp = 0xfffd;
+    return 1;
+  }
+  int j;
+  for (j = 1; j < n; j++) {
+    if ((u[j] & 0xc0) != 0x80) {
+      *cp = 0xfffd;
+      return 1;
+    }
+    c = (c << 6) | (u[j] & 0x3f);
+  }
+  *cp = c;
+  return n;
+}
+
+int editorIsContinuation(char c) {
+  return ((unsigned char) c & 0xc0) == 0x80;
+}
+
+/* Checks 16 bytes at a time with SSE2 where available, 8 at a time
+ * otherwise, for the high bit that every non-ASCII byte has */
+int editorIsAscii(const char *s, int length) {
+  int j = 0;
+#ifdef __SSE2__
+  for (; j + 16 <= length; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &s[j]);
+    if (_mm_movemask_epi8(v))
+      return 0;
+  }
+#else
+  for (; j + 8 <= length; j += 8) {
+    uint64_t v;
+    memcpy(&v, &s[j], sizeof(v));
+    if (v & 0x8080808080808080ULL)
+      return 0;
+  }
+#endif
+  for (; j < length; j++) {
+    if ((unsigned char) s[j] >= 0x80)
+      return 0;
+  }
+  return 1;
+}
+
+// Start of the character containing byte i of row
+int editorRowCharStart(erow *row, int i) {
+  if (row->ascii)
+    return i;
+  while (i > 0 && i < row->size && editorIsContinuation(row->chars[i]))
+    i--;
+  return i;
+}
+
+// Byte just after the character starting at i
+int editorRowNextChar(erow *row, int i) {
+  i++;
+  if (!row->ascii) {
+    while (i < row->size && editorIsContinuation(row->chars[i]))
+      i++;
+  }
+  return i;
+}
+
+// Start of the character before byte i
+int editorRowPrevChar(erow *row, int i) {
+  if (i <= 0)
+    return 0;
+  return editorRowCharStart(row, i - 1);
+}
+
+/* Doc: editorRenderSpan
+ ----------------------------------------------
+ * Finds the bytes of render that fall in the
+ *     screen columns [col, col + width)
+ *
+ * * returns the number of bytes, and where
+ * *     they start in *start
+ * * *lead is set to the number of columns a
+ * *     wide character cut by col leaves blank
+ * *     at the start of the span
+ *
+ ----------------------------------------------*/
+int editorRenderSpan(erow *row, int col, int width, int *start, int *lead) {
+  *lead = 0;
+  if (row->ascii) {
+    int len = row->rsize - col;
+    if (len < 0)
+      len = 0;
+    if (len > width)
+      len = width;
+    *start = col < row->rsize ? col : row->rsize;
+    return len;
+  }
+
+  int i = 0, x = 0;
+  uint32_t cp;
+  while (i < row->rsize && x < col) {
+    int n = editorUtf8Decode(&row->render[i], row->rsize - i, &cp);
+    x += editorCharWidth(cp);
+    i += n;
+  }
+  // Skip combining marks left over from the last character off screen
+  while (i < row->rsize && x == col) {
+    int n = editorUtf8Decode(&row->render[i], row->rsize - i, &cp);
+    if (editorCharWidth(cp) != 0)
+      break;
+    i += n;
+  }
+  if (x > col)
+    *lead = x - col;
+  *start = i;
+
+  x = *lead;
+  while (i < row->rsize) {
+    int n = editorUtf8Decode(&row->render[i], row->rsize - i, &cp);
+    int w = editorCharWidth(cp);
+    if (x + w > width)
+      break;
+    x += w;
+    i += n;
+  }
+  return i - *start;
+}
+
+/* Folding */
+
+// Index of the fold whose range [start, end] holds row at, or -1
+int editorFoldFind(int at) {
+  int lo = 0, hi = E.numfolds - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (at < E.folds[mid].start)
+      hi = mid - 1;
+    else if (at > E.folds[mid].end)
+      lo = mid + 1;
+    else
+      return mid;
+  }
+  return -1;
+}
+
+int editorRowHidden(int at) {
+  if (E.numfolds == 0)
+    return 0;
+  int f = editorFoldFind(at);
+  return f != -1 && at > E.folds[f].start;
+}
+
+int editorRowFolded(int at) {
+  if (E.numfolds == 0)
+    return 0;
+  int f = editorFoldFind(at);
+  return f != -1 && at == E.folds[f].start;
+}
+
+// Rows hidden by folds in [0, at)
+int editorHiddenBefore(int at) {
+  if (E.numfolds == 0)
+    return 0;
+
+  // Last fold starting before at
+  int lo = 0, hi = E.numfolds - 1, k = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (E.folds[mid].start < at) {
+      k = mid;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+  if (k == -1)
+    return 0;
+
+  int hidden = E.fold_hidden[k];
+  struct fold *f = &E.folds[k];
+  int last = at - 1 < f->end ? at - 1 : f->end;
+  return hidden + (last - f->start);
+}
+
+// Rows on screen between from (inclusive) and to (exclusive)
+int editorVisibleBetween(int from, int to) {
+  if (E.numfolds == 0)
+    return to - from;
+  return (to - from) - (editorHiddenBefore(to) - editorHiddenBefore(from));
+}
+
+int editorNextVisibleRow(int at) {
+  at++;
+  if (E.numfolds) {
+    int f = editorFoldFind(at);
+    if (f != -1 && at > E.folds[f].start)
+      at = E.folds[f].end + 1;
+  }
+  return at < E.numrows ? at : E.numrows;
+}
+
+int editorPrevVisibleRow(int at) {
+  if (at <= 0)
+    return 0;
+  at--;
+  if (E.numfolds) {
+    int f = editorFoldFind(at);
+    if (f != -1)
+      at = E.folds[f].start;
+  }
+  return at;
+}
+
+// Rows [start, end] were folded or unfolded
+void editorFoldsChanged(int start, int end) {
+  int i, hidden = 0;
+  E.fold_hidden = realloc(E.fold_hidden, sizeof(int) * (E.numfolds + 1));
+  for (i = 0; i < E.numfolds; i++) {
+    E.fold_hidden[i] = hidden;
+    hidden += E.folds[i].end - E.folds[i].start;
+  }
+  E.fold_hidden[E.numfolds] = hidden;
+
+  if (end < E.wrap_clean) {
+    for (i = start; i <= end; i++)
+      editorWrapUpdateRow(i);
+  }
+  else {
+    editorWrapInvalidate(start);
+  }
+}
+
+/* Collapses rows [start, end]. Folds inside the range are swallowed by the
+ * new one; a fold that only partly overlaps stops the fold from being
+ * made. */
+int editorFoldAdd(int start, int end) {
+  if (end <= start || start < 0 || end >= E.numrows)
+    return 0;
+
+  int i, first = E.numfolds, count = 0;
+  for (i = 0; i < E.numfolds; i++) {
+    struct fold *f = &E.folds[i];
+    if (f->end < start || f->start > end)
+      continue;
+    if (f->start < start || f->end > end)
+      return 0;
+    if (i < first)
+      first = i;
+    count++;
+  }
+  if (count == 0) {
+    first = 0;
+    while (first < E.numfolds && E.folds[first].start < start)
+      first++;
+  }
+
+  if (E.numfolds + 1 > E.foldcap) {
+    E.foldcap = E.foldcap ? E.foldcap * 2 : 16;
+    E.folds = realloc(E.folds, sizeof(struct fold) * E.foldcap);
+  }
+  memmove(&E.folds[first + 1], &E.folds[first + count],
+      sizeof(struct fold) * (E.numfolds - first - count));
+  E.folds[first].start = start;
+  E.folds[first].end = end;
+  E.numfolds += 1 - count;
+  editorFoldsChanged(start, end);
+  return 1;
+}
+
+void editorFoldRemove(int f) {
+  struct fold removed = E.folds[f];
+  memmove(&E.folds[f], &E.folds[f + 1],
+      sizeof(struct fold) * (E.numfolds - f - 1));
+  E.numfolds--;
+  editorFoldsChanged(removed.start, removed.end);
+}
+
+// Rows [at, at + delcount) were replaced by inscount new ones
+void editorFoldShift(int at, int delcount, int inscount) {
+  if (E.numfolds == 0)
+    return;
+
+  int i, j = 0;
+  int from = at;
+  for (i = 0; i < E.numfolds; i++) {
+    struct fold f = E.folds[i];
+    if (f.end < at) {
+      E.folds[j++] = f;
+    }
+    else if (f.start >= at + delcount) {
+      f.start += inscount - delcount;
+      f.end += inscount - delcount;
+      E.folds[j++] = f;
+    }
+    // Folds the edit reaches into are opened
+    else if (f.start < from) {
+      from = f.start;
+    }
+  }
+  E.numfolds = j;
+  editorFoldsChanged(from, E.numrows);
+}
+
+int editorRowIndent(erow *row) {
+  int i = 0;
+  while (i < row->rsize && row->render[i] == ' ')
+    i++;
+  return i == row->rsize ? -1 : i;
+}
+
+/* Finds the row holding the bracket closing the last one left open on row
+ * at, or -1. Only scans as far as it has to, and with a syntax selected
+ * skips brackets inside strings and comments. */
+int editorFoldBracketEnd(int at) {
+  int in_comment = 0;
+  if (E.syntax && at > 0) {
+    editorSyntaxUpdate(at - 1, 0, 0);
+    in_comment = E.row[at - 1].hl_open;
+  }
+
+  unsigned char *hl = NULL;
+  int hlcap = 0;
+  int depth = 0;
+  int open = 0;
+  int end = -1;
+  int r, j;
+  for (r = at; r < E.numrows && end == -1; r++) {
+    erow *row = &E.row[r];
+    if (E.syntax) {
+      if (row->rsize > hlcap) {
+        hlcap = row->rsize;
+        hl = realloc(hl, hlcap);
+      }
+      // Lex a copy, the row's own hl_open is what re-lexing compares to
+      erow copy = *row;
+      in_comment = editorSyntaxLex(&copy, in_comment, hl);
+    }
+
+    for (j = 0; j < row->rsize; j++) {
+      if (hl && (hl[j] == HL_STRING || hl[j] == HL_COMMENT ||
+            hl[j] == HL_MLCOMMENT))
+        continue;
+      char c = row->render[j];
+      if (c == '{' || c == '[' || c == '(')
+        depth++;
+      else if (c == '}' || c == ']' || c == ')') {
+        if (r == at && depth == 0)
+          continue;
+        depth--;
+        if (r > at && depth < open) {
+          end = r;
+          break;
+        }
+      }
+    }
+    if (r == at) {
+      if (depth == 0)
+        break;
+      open = depth;
+    }
+  }
+  free(hl);
+  return end;
+}
+
+// Last row of the block indented deeper than row at, or -1
+int editorFoldIndentEnd(int at) {
+  int base = editorRowIndent(&E.row[at]);
+  if (base == -1)
+    return -1;
+
+  int end = -1;
+  int r;
+  for (r = at + 1; r < E.numrows; r++) {
+    int indent = editorRowIndent(&E.row[r]);
+    if (indent == -1)
+      continue;
+    if (indent <= base)
+      break;
+    end = r;
+  }
+  return end;
+}
+
+/* Folds the block starting at row at, found by bracket matching first and
+ * indentation second. Nothing is computed ahead of time, the block is only
+ * looked for when asked. */
+int editorFoldBlock(int at) {
+  if (at >= E.numrows || editorRowFolded(at))
+    return 0;
+  int end = editorFoldBracketEnd(at);
+  if (end == -1)
+    end = editorFoldIndentEnd(at);
+  return end != -1 && editorFoldAdd(at, end);
+}
+
+// Folds every block that starts on screen
+void editorFoldVisible() {
+  int r = E.rowoff;
+  int i;
+  for (i = 0; i < E.screenrows && r < E.numrows; i++) {
+    editorFoldBlock(r);
+    r = editorNextVisibleRow(r);
+  }
+}
+
+// Opens the fold hiding the cursor, for jumps that land inside one
+void editorFoldRevealCursor() {
+  while (E.cy < E.numrows && editorRowHidden(E.cy))
+    editorFoldRemove(editorFoldFind(E.cy));
+}
+
+void editorFoldCommand() {
+  int c = editorReadKey();
+  int f = E.cy < E.numrows ? editorFoldFind(E.cy) : -1;
+
+  switch (c) {
+    case 'c':
+      if (!editorFoldBlock(E.cy))
+        editorSetStatusMessage("No fold here");
+      break;
+    case 'o':
+      if (f != -1)
+        editorFoldRemove(f);
+      break;
+    case 'a':
+      if (f != -1)
+        editorFoldRemove(f);
+      else if (!editorFoldBlock(E.cy))
+        editorSetStatusMessage("No fold here");
+      break;
+    case 'M':
+      editorFoldVisible();
+      break;
+    case 'R':
+      if (E.numfolds) {
+        int start = E.folds[0].start;
+        E.numfolds = 0;
+        editorFoldsChanged(start, E.numrows);
+      }
+      break;
+  }
+}
+
+/* Word index */
+
+int editorIsWordChar(int c) {
+  c = (unsigned char) c;
+  return isalnum(c) || c == '_' || c >= 128;
+}
+
+int editorWordNewNode(unsigned char c) {
+  if (E.widx_len == E.widx_cap) {
+    E.widx_cap = E.widx_cap ? E.widx_cap * 2 : 1024;
+    E.widx = realloc(E.widx, sizeof(struct editorWordNode) * E.widx_cap);
+    if (E.widx == NULL)
+      die("realloc");
+  }
+  struct editorWordNode *node = &E.widx[E.widx_len];
+  node->child = 0;
+  node->sibling = 0;
+  node->count = 0;
+  node->words = 0;
+  node->c = c;
+  return E.widx_len++;
+}
+
+// Child of n for c, added in order if create is set. 0 if there is none.
+int editorWordChild(int n, unsigned char c, int create) {
+  int prev = 0;
+  int cur = E.widx[n].child;
+  while (cur && E.widx[cur].c < c) {
+    prev = cur;
+    cur = E.widx[cur].sibling;
+  }
+  if (cur && E.widx[cur].c == c)
+    return cur;
+  if (!create)
+    return 0;
+
+  int m = editorWordNewNode(c);
+  E.widx[m].sibling = cur;
+  if (prev)
+    E.widx[prev].sibling = m;
+  else
+    E.widx[n].child = m;
+  return m;
+}
+
+// Node the word ends at, 0 if it isn't in the trie
+int editorWordFind(const char *w, int length) {
+  if (E.widx_len == 0)
+    return 0;
+  int n = 0;
+  int i;
+  for (i = 0; i < length && (i == 0 || n); i++)
+    n = editorWordChild(n, w[i], 0);
+  return n;
+}
+
+void editorWordAdjust(const char *w, int length, int delta) {
+  int path[CERAMIC_WORD_MAX + 1];
+  if (E.widx_len == 0)
+    editorWordNewNode(0);
+
+  int n = 0;
+  int i;
+  path[0] = 0;
+  for (i = 0; i < length; i++) {
+    n = editorWordChild(n, w[i], delta > 0);
+    if (n == 0)
+      return;
+    path[i + 1] = n;
+  }
+
+  int before = E.widx[n].count;
+  E.widx[n].count += delta;
+  if (E.widx[n].count < 0)
+    E.widx[n].count = 0;
+  int change = (before == 0 && E.widx[n].count > 0) -
+      (before > 0 && E.widx[n].count == 0);
+  if (change) {
+    for (i = 0; i <= length; i++)
+      E.widx[path[i]].words += change;
+  }
+}
+
+// Adds (delta 1) or removes (delta -1) the words in s[from, to)
+void editorWordsAdjust(const char *s, int from, int to, int delta) {
+  int i = from;
+  while (i < to) {
+    while (i < to && !editorIsWordChar(s[i]))
+      i++;
+    int start = i;
+    while (i < to && editorIsWordChar(s[i]))
+      i++;
+    int length = i - start;
+    if (length >= CERAMIC_WORD_MIN && length <= CERAMIC_WORD_MAX)
+      editorWordAdjust(&s[start], length, delta);
+  }
+}
+
+/* Indexes s[from, to) of row, if row is one of the rows the index already
+ * covers. Edits bracket the bytes they touch, widened to whole words with
+ * editorWordStart and editorWordEnd, with a -1 before and a 1 after. */
+void editorWordsSpan(erow *row, int from, int to, int delta) {
+  if (row >= E.row && row < E.row + E.widx_built)
+    editorWordsAdjust(row->chars, from, to, delta);
+}
+
+int editorWordStart(erow *row, int i) {
+  while (i > 0 && editorIsWordChar(row->chars[i - 1]))
+    i--;
+  return i;
+}
+
+int editorWordEnd(erow *row, int i) {
+  while (i < row->size && editorIsWordChar(row->chars[i]))
+    i++;
+  return i;
+}
+
+// Rows [at, at + count) were just inserted
+void editorWordsInsertRows(int at, int count) {
+  if (at >= E.widx_built)
+    return;
+  E.widx_built += count;
+  int j;
+  for (j = at; j < at + count; j++)
+    editorWordsAdjust(E.row[j].chars, 0, E.row[j].size, 1);
+}
+
+// Rows [at, at + count) are about to go
+void editorWordsDeleteRows(int at, int count) {
+  if (at >= E.widx_built)
+    return;
+  int j;
+  for (j = at; j < at + count && j < E.widx_built; j++)
+    editorWordsAdjust(E.row[j].chars, 0, E.row[j].size, -1);
+  E.widx_built = at + count <= E.widx_built ? E.widx_built - count : at;
+}
+
+int editorWordsPending() {
+  return E.widx_built < E.numrows;
+}
+
+// Indexes rows past widx_built for up to CERAMIC_WORD_BUILD_MS
+void editorWordsBuild() {
+  long start = editorNow();
+  while (E.widx_built < E.numrows) {
+    int end = E.widx_built + 1024;
+    if (end > E.numrows)
+      end = E.numrows;
+    for (; E.widx_built < end; E.widx_built++) {
+      erow *row = &E.row[E.widx_built];
+      editorWordsAdjust(row->chars, 0, row->size, 1);
+    }
+    if (editorNow() - start >= CERAMIC_WORD_BUILD_MS)
+      break;
+  }
+}
+
+// Number of distinct indexed words sorting before w
+int editorWordRank(const char *w, int length) {
+  if (E.widx_len == 0)
+    return 0;
+  int n = 0;
+  int rank = 0;
+  int i;
+  for (i = 0; i < length; i++) {
+    // A word that is a prefix of w sorts before it
+    if (i > 0 && E.widx[n].count > 0)
+      rank++;
+    int ch = E.widx[n].child;
+    while (ch && E.widx[ch].c < (unsigned char) w[i]) {
+      rank += E.widx[ch].words;
+      ch = E.widx[ch].sibling;
+    }
+    if (ch == 0 || E.widx[ch].c != (unsigned char) w[i])
+      return rank;
+    n = ch;
+  }
+  return rank;
+}
+
+// Copies the rank-th indexed word into out and returns its length
+int editorWordSelect(int rank, char *out) {
+  int n = 0;
+  int length = 0;
+  while (1) {
+    if (n != 0 && E.widx[n].count > 0) {
+      if (rank == 0)
+        return length;
+      rank--;
+    }
+    int ch = E.widx[n].child;
+    while (ch && rank >= E.widx[ch].words) {
+      rank -= E.widx[ch].words;
+      ch = E.widx[ch].sibling;
+    }
+    if (ch == 0 || length == CERAMIC_WORD_MAX)
+      return -1;
+    out[length++] = E.widx[ch].c;
+    n = ch;
+  }
+}
+
+/* Soft wrap */
+
+// Screen lines row at takes, none when a fold hides it
+int editorWrapLines(int at) {
+  erow *row = &E.row[at];
+  if (editorRowHidden(at))
+    return 0;
+  if (row->rwidth <= E.screencols)
+    return 1;
+  return (row->rwidth + E.screencols - 1) / E.screencols;
+}
+
+/* Doc: editorWrapBuild
+ ----------------------------------------------
+ * Rebuilds the wrap index from row wrap_clean
+ *     on, in O(n - wrap_clean + log² n)
+ *
+ * * only needs rwidth, which every row keeps
+ * *     up to date, so nothing is re-measured
+ * * nodes covering only rows before
+ * *     wrap_clean are still right and are
+ * *     kept; the few reaching back across it
+ * *     get the rows before it added from
+ * *     prefix sums
+ *
+ ----------------------------------------------*/
+void editorWrapBuild() {
+  int n = E.numrows;
+  int k = E.wrap_clean < n ? E.wrap_clean : n;
+  if (n + 1 > E.wrap_treecap) {
+    E.wrap_treecap = (n + 1) * 2;
+    E.wrap_tree = realloc(E.wrap_tree, sizeof(int) * E.wrap_treecap);
+    if (E.wrap_tree == NULL)
+      die("realloc");
+  }
+
+  int *t = E.wrap_tree;
+  int i;
+  t[0] = 0;
+  for (i = k + 1; i <= n; i++) {
+    E.row[i - 1].wraplines = editorWrapLines(i - 1);
+    t[i] = E.row[i - 1].wraplines;
+  }
+  for (i = k + 1; i <= n; i++) {
+    int j = i + (i & -i);
+    if (j <= n)
+      t[j] += t[i];
+  }
+  if (k > 0) {
+    int before = editorWrapPrefix(k);
+    for (i = k + (k & -k); i <= n; i += i & -i)
+      t[i] += before - editorWrapPrefix(i - (i & -i));
+  }
+  E.wrap_clean = n;
+}
+
+void editorWrapEnsure() {
+  if (E.wrap_clean < E.numrows || E.wrap_tree == NULL)
+    editorWrapBuild();
+}
+
+// Screen lines taken by rows [0, at)
+int editorWrapPrefix(int at) {
+  int sum = 0;
+  for (; at > 0; at -= at & -at)
+    sum += E.wrap_tree[at];
+  return sum;
+}
+
+int editorWrapTotal() {
+  return editorWrapPrefix(E.numrows);
+}
+
+/* Finds the row holding screen line line, and which of its lines that is.
+ * Lines past the end land on row numrows. */
+void editorWrapFind(int line, int *at, int *off) {
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= E.numrows)
+    step *= 2;
+
+  // Largest pos with prefix(pos) <= line
+  for (; step; step /= 2) {
+    if (pos + step <= E.numrows && E.wrap_tree[pos + step] <= line) {
+      pos += step;
+      line -= E.wrap_tree[pos];
+    }
+  }
+  *at = pos;
+  *off = line;
+  if (pos < E.numrows && *off >= E.row[pos].wraplines)
+    *off = E.row[pos].wraplines - 1;
+}
+
+// The rendered width of row at changed
+void editorWrapUpdateRow(int at) {
+  if (at >= E.wrap_clean)
+    return;
+  erow *row = &E.row[at];
+  int lines = editorWrapLines(at);
+  int delta = lines - row->wraplines;
+  if (delta == 0)
+    return;
+  row->wraplines = lines;
+  // Nodes past wrap_clean may not exist yet and are rebuilt anyway
+  int i;
+  for (i = at + 1; i <= E.wrap_clean; i += i & -i)
+    E.wrap_tree[i] += delta;
+}
+
+// Rows from at on were added, removed or changed in bulk
+void editorWrapInvalidate(int at) {
+  if (at < E.wrap_clean)
+    E.wrap_clean = at;
+}
+
+// Screen line the cursor is on, counted from the top of the buffer
+int editorWrapCursorLine() {
+  int line = editorWrapPrefix(E.cy);
+  if (E.cy < E.numrows) {
+    int off = E.rx / E.screencols;
+    if (off >= E.row[E.cy].wraplines)
+      off = E.row[E.cy].wraplines - 1;
+    line += off;
+  }
+  return line;
+}
+
+void editorToggleWrap() {
+  if (E.csv) {
+    editorSetStatusMessage("No soft wrap in the columnar view");
+    return;
+  }
+  E.wrap = !E.wrap;
+  E.wrapoff = 0;
+  E.coloff = 0;
+  editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/* Columnar view */
+
+// Index of the delimiter ending the field that starts at i, or row->size
+int editorCsvFieldEnd(erow *row, int i) {
+  int quoted = 0;
+  for (; i < row->size; i++) {
+    char c = row->chars[i];
+    if (c == '"' && E.csv != '\t')
+      quoted = !quoted;
+    else if (c == E.csv && !quoted)
+      return i;
+  }
+  return i;
+}
+
+// Display width of s[0, length), tabs inside a field count as one column
+int editorCsvTextWidth(const char *s, int length) {
+  int width = 0;
+  int j = 0;
+  while (j < length) {
+    uint32_t cp;
+    j += editorUtf8Decode(&s[j], length - j, &cp);
+    width += cp == '\t' ? 1 : editorCharWidth(cp);
+  }
+  return width;
+}
+
+// Width of column col for a field whose text is width wide
+int editorCsvColWidth(int col, int width) {
+  if (col < E.csv_numcols)
+    return E.csv_widths[col];
+  if (width < 1)
+    width = 1;
+  return width < CERAMIC_CSV_MAX_WIDTH ? width : CERAMIC_CSV_MAX_WIDTH;
+}
+
+void editorCsvMeasureRow(erow *row) {
+  int col = 0;
+  int i = 0;
+  while (1) {
+    int end = editorCsvFieldEnd(row, i);
+    int width = editorCsvTextWidth(&row->chars[i], end - i);
+    if (width < 1)
+      width = 1;
+    if (width > CERAMIC_CSV_MAX_WIDTH)
+      width = CERAMIC_CSV_MAX_WIDTH;
+
+    if (col >= E.csv_numcols) {
+      E.csv_widths = realloc(E.csv_widths, sizeof(int) * (col + 1));
+      E.csv_widths[col] = 0;
+      E.csv_numcols = col + 1;
+    }
+    if (width > E.csv_widths[col])
+      E.csv_widths[col] = width;
+
+    if (end >= row->size)
+      break;
+    i = end + 1;
+    col++;
+  }
+}
+
+/* Widens columns to fit rows [from, to), plus the first
+ * CERAMIC_CSV_SAMPLE rows the first time round so the columns don't jump
+ * around much while scrolling away from the top. An edit clears
+ * csv_sampled, which measures from scratch so a shortened field can give
+ * its room back. */
+void editorCsvMeasure(int from, int to) {
+  int i;
+  if (!E.csv_sampled && E.numrows > 0) {
+    E.csv_numcols = 0;
+    for (i = 0; i < E.numrows && i < CERAMIC_CSV_SAMPLE; i++)
+      editorCsvMeasureRow(&E.row[i]);
+    E.csv_sampled = 1;
+  }
+  for (i = from; i < to && i < E.numrows; i = editorNextVisibleRow(i))
+    editorCsvMeasureRow(&E.row[i]);
+}
+
+void editorCsvSet(int delim) {
+  E.csv = delim;
+  free(E.csv_widths);
+  E.csv_widths = NULL;
+  E.csv_numcols = 0;
+  E.csv_sampled = 0;
+  E.coloff = 0;
+  if (delim) {
+    E.wrap = 0;
+    E.wrapoff = 0;
+  }
+}
+
+// Picks the columnar view from the file extension, like the syntax does
+void editorCsvSelect() {
+  char *ext = E.filename ? strrchr(E.filename, '.') : NULL;
+  if (ext && strcasecmp(ext, ".csv") == 0)
+    editorCsvSet(',');
+  else if (ext && strcasecmp(ext, ".tsv") == 0)
+    editorCsvSet('\t');
+  else
+    editorCsvSet(0);
+}
+
+int editorCsvCxToRx(erow *row, int cx) {
+  int rx = 0;
+  int col = 0;
+  int i = 0;
+  while (1) {
+    int end = editorCsvFieldEnd(row, i);
+    int width = editorCsvColWidth(col,
+        editorCsvTextWidth(&row->chars[i], end - i));
+    if (cx <= end) {
+      int w = editorCsvTextWidth(&row->chars[i], cx - i);
+      // Characters cut off at the column edge share its last column
+      if (cx == end)
+        return rx + (w < width ? w : width);
+      return rx + (w < width ? w : width - 1);
+    }
+    if (end >= row->size)
+      return rx + width;
+    rx += width + CERAMIC_CSV_GAP;
+    i = end + 1;
+    col++;
+  }
+}
+
+int editorCsvRxToCx(erow *row, int rx) {
+  int start = 0;
+  int col = 0;
+  int i = 0;
+  while (1) {
+    int end = editorCsvFieldEnd(row, i);
+    int width = editorCsvColWidth(col,
+        editorCsvTextWidth(&row->chars[i], end - i));
+    if (rx < start + width) {
+      int cx = i;
+      int w = 0;
+      while (cx < end) {
+        uint32_t cp;
+        int n = editorUtf8Decode(&row->chars[cx], end - cx, &cp);
+        w += cp == '\t' ? 1 : editorCharWidth(cp);
+        if (start + w > rx)
+          return cx;
+        cx += n;
+      }
+      return end;
+    }
+    if (rx < start + width + CERAMIC_CSV_GAP || end >= row->size)
+      return end;
+    start += width + CERAMIC_CSV_GAP;
+    i = end + 1;
+    col++;
+  }
+}
+
+/* Moves the cursor to the start of the next field, or to the start of the
+ * current or previous one */
+void editorCsvMoveField(int dir) {
+  if (E.cy >= E.numrows)
+    return;
+  erow *row = &E.row[E.cy];
+  int prev = 0, start = 0;
+  int end = editorCsvFieldEnd(row, 0);
+  while (end < E.cx && end < row->size) {
+    prev = start;
+    start = end + 1;
+    end = editorCsvFieldEnd(row, start);
+  }
+  if (E.cx > end)
+    E.cx = end;
+
+  if (dir > 0) {
+    if (end < row->size)
+      E.cx = end + 1;
+  }
+  else {
+    E.cx = E.cx > start ? start : prev;
+  }
+  if (E.cx >= row->size && E.mode == NORMAL)
+    E.cx = row->size > 0 ? row->size - 1 : 0;
+  E.r_mov = 1;
+}
+
+/* row operations */
+
+int editorRowCxToRx(erow *row, int cx) {
+  if (E.csv)
+    return editorCsvCxToRx(row, cx);
+  int rx = 0;
+  int j;
+  if (row->ascii) {
+    for (j = 0; j < cx; j++) {
+      if (row->chars[j] == '\t')
+        rx += (CERAMIC_TAB_STOP - 1) - (rx % CERAMIC_TAB_STOP);
+      rx++;
+    }
+    return rx;
+  }
+
+  j = 0;
+  while (j < cx && j < row->size) {
+    uint32_t cp;
+    int n = editorUtf8Decode(&row->chars[j], row->size - j, &cp);
+    if (cp == '\t')
+      rx += CERAMIC_TAB_STOP - (rx % CERAMIC_TAB_STOP);
+    else
+      rx += editorCharWidth(cp);
+    j += n;
+  }
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  if (E.csv)
+    return editorCsvRxToCx(row, rx);
+  int cur_rx = 0;
+  int cx;
+  if (row->ascii) {
+    for (cx = 0; cx < row->size; cx++) {
+      if (row->chars[cx] == '\t')
+        cur_rx += (CERAMIC_TAB_STOP - 1) - (cur_rx % CERAMIC_TAB_STOP);
+      cur_rx++;
+
+      if (cur_rx > rx)
+        return cx;
+    }
+    return cx;
+  }
+
+  cx = 0;
+  while (cx < row->size) {
+    uint32_t cp;
+    int n = editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (cp == '\t')
+      cur_rx += CERAMIC_TAB_STOP - (cur_rx % CERAMIC_TAB_STOP);
+    else
+      cur_rx += editorCharWidth(cp);
+
+    if (cur_rx > rx)
+      return cx;
+    cx += n;
+  }
+  return cx;
+}
+
+/* Rebuilds everything in row that only depends on its chars. Touches no
+ * editor state, so it's safe to call from worker threads. */
+void editorRenderRow(erow *row) {
+  int tabs = 0;
+  int j;
+  for(j = 0; j < row->size; j++)
+    if (row->chars[j] == '\t')
+      tabs++;
+
+  editorBufRelease(row->render);
+  row->render = editorBufAlloc(row->size + tabs*(CERAMIC_TAB_STOP - 1) + 1);
+
+  row->ascii = editorIsAscii(row->chars, row->size);
+
+  int idx = 0;
+  if (row->ascii) {
+    for (j = 0; j < row->size; j++) {
+      if (row->chars[j] == '\t') {
+        row->render[idx++] = ' ';
+        while (idx % CERAMIC_TAB_STOP != 0)
+          row->render[idx++] = ' ';
+      }
+      else {
+        row->render[idx++] = row->chars[j];
+      }
+    }
+    row->rwidth = idx;
+  }
+  else {
+    // Tab stops are in columns, which no longer match bytes
+    int col = 0;
+    j = 0;
+    while (j < row->size) {
+      uint32_t cp;
+      int n = editorUtf8Decode(&row->chars[j], row->size - j, &cp);
+      if (cp == '\t') {
+        do {
+          row->render[idx++] = ' ';
+          col++;
+        } while (col % CERAMIC_TAB_STOP != 0);
+      }
+      else {
+        memcpy(&row->render[idx], &row->chars[j], n);
+        idx += n;
+        col += editorCharWidth(cp);
+      }
+      j += n;
+    }
+    row->rwidth = col;
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+
+  row->hash = editorHashBytes(row->chars, row->size);
+
+  // hl_open stays, it is what a re-lex gets compared against
+  free(row->hl);
+  row->hl = NULL;
+}
+
+void editorUpdateRow(erow *row) {
+  editorRenderRow(row);
+  if (row >= E.row && row < E.row + E.numrows) {
+    editorSyntaxInvalidate(row - E.row, 1);
+    editorWrapUpdateRow(row - E.row);
+    E.csv_sampled = 0;
+  }
+}
+
+void editorReserveRows(int count) {
+  if (count <= E.rowcap)
+    return;
+  int cap = E.rowcap ? E.rowcap : 16;
+  while (cap < count)
+    cap *= 2;
+  E.row = realloc(E.row, sizeof(erow) * cap);
+  if (E.row == NULL)
+    die("realloc");
+  E.rowcap = cap;
+}
+
+// Fills in a row that isn't yet part of E.row
+void editorInitRow(erow *row, const char *s, size_t length) {
+  row->size = length;
+  row->chars = editorBufAlloc(length + 1);
+  memcpy(row->chars, s, length);
+  row->chars[length] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_open = -1;
+  editorUpdateRow(row);
+}
+
+void editorInsertRow (int i, char *s, size_t length) {
+  if (i < 0 || i > E.numrows)
+    return;
+
+  editorReserveRows(E.numrows + 1);
+  memmove(&E.row[i+1], &E.row[i], sizeof(erow) * (E.numrows - i));
+
+  editorInitRow(&E.row[i], s, length);
+
+  E.numrows++;
+  E.dirty++;
+  editorWordsInsertRows(i, 1);
+  editorSyntaxShift(i, 0, 1);
+  editorFoldShift(i, 0, 1);
+  editorWrapInvalidate(i);
+}
+
+void editorFreeRow(erow *row) {
+  editorBufRelease(row->render);
+  editorBufRelease(row->chars);
+  free(row->hl);
+}
+
+/* Returns a new row sharing chars and render with row. Whoever ends up
+ * with it releases it with editorFreeRow as usual. */
+erow editorShareRow(erow *row) {
+  erow copy = *row;
+  editorBufRetain(copy.chars);
+  editorBufRetain(copy.render);
+  copy.hl = NULL;
+  copy.hl_open = -1;
+  return copy;
+}
+
+void editorDeleteRow(int i) {
+  if (i < 0 || i >= E.numrows)
+    return;
+  editorWordsDeleteRows(i, 1);
+  editorFreeRow(&E.row[i]);
+  memmove(&E.row[i], &E.row[i+1], sizeof(erow) * (E.numrows - i - 1));
+  E.numrows--;
+  E.dirty++;
+  editorSyntaxShift(i, 1, 0);
+  editorFoldShift(i, 1, 0);
+  editorWrapInvalidate(i);
+}
+
+/* Replaces rows [at, at + delcount) with the inscount rows in rows, moving
+ * the tail of the buffer only once. The inserted rows are taken over as
+ * they are, so they must have been set up with editorInitRow. */
+void editorSpliceRows(int at, int delcount, erow *rows, int inscount) {
+  if (at < 0 || at > E.numrows)
+    return;
+  if (delcount > E.numrows - at)
+    delcount = E.numrows - at;
+
+  editorWordsDeleteRows(at, delcount);
+  int j;
+  for (j = at; j < at + delcount; j++)
+    editorFreeRow(&E.row[j]);
+
+  editorReserveRows(E.numrows - delcount + inscount);
+  memmove(&E.row[at + inscount], &E.row[at + delcount],
+      sizeof(erow) * (E.numrows - at - delcount));
+  if (inscount)
+    memcpy(&E.row[at], rows, sizeof(erow) * inscount);
+
+  E.numrows += inscount - delcount;
+  E.dirty++;
+  editorWordsInsertRows(at, inscount);
+  editorSyntaxShift(at, delcount, inscount);
+  editorFoldShift(at, delcount, inscount);
+  editorWrapInvalidate(at);
+  if (delcount)
+    E.csv_sampled = 0;
+}
+
+void editorRowInsertChar(erow *row, int i, int c) {
+  if (i < 0 || i > row->size)
+    i = row->size;
+  int start = editorWordStart(row, i);
+  int end = editorWordEnd(row, i);
+  editorWordsSpan(row, start, end, -1);
+  row->chars = editorBufResize(row->chars, row->size + 1, row->size + 2);
+  memmove(&row->chars[i+1] ,&row->chars[i], row->size - i + 1);
+  row->size++;
+  row->chars[i] = c;
+  editorWordsSpan(row, start, end + 1, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  }
+  else {
+    erow *row = &E.row[E.cy];
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = &E.row[E.cy];
+    int start = editorWordStart(row, E.cx);
+    editorWordsSpan(row, start, editorWordEnd(row, E.cx), -1);
+    editorRowMakeWritable(row);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorWordsSpan(row, start, row->size, 1);
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  int start = editorWordStart(row, row->size);
+  editorWordsSpan(row, start, row->size, -1);
+  row->chars = editorBufResize(row->chars, row->size + 1,
+      row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorWordsSpan(row, start, row->size, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowDeleteChar(erow *row, int i) {
+  if (i < 0 || i >= row->size)
+    return;
+  int start = editorWordStart(row, i);
+  int end = editorWordEnd(row, i + 1);
+  editorWordsSpan(row, start, end, -1);
+  editorRowMakeWritable(row);
+  memmove(&row->chars[i], &row->chars[i+1], row->size - i);
+  row->size--;
+  editorWordsSpan(row, start, end - 1, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/* Parallel work */
+
+struct editorTask {
+  void (*fn)(int, int, int, void *);
+  int chunk;
+  int start;
+  int end;
+  void *arg;
+};
+
+void *editorTaskRun(void *p) {
+  struct editorTask *t = p;
+  t->fn(t->chunk, t->start, t->end, t->arg);
+  return NULL;
+}
+
+int editorThreadCount(int count) {
+  if (count < CERAMIC_PARALLEL_MIN_ROWS)
+    return 1;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > CERAMIC_MAX_THREADS)
+    n = CERAMIC_MAX_THREADS;
+  return n;
+}
+
+/* Doc: editorParallelFor
+ ----------------------------------------------
+ * Splits [start, end) into nchunks even chunks
+ *     and runs fn(chunk, from, to, arg) on
+ *     each, one thread per chunk
+ *
+ * * the calling thread runs the first chunk
+ * * falls back to running a chunk inline when
+ * *     a thread can't be created
+ * * fn must not touch editor state beyond the
+ * *     rows it was given
+ *
+ ----------------------------------------------*/
+void editorParallelFor(int nchunks, int start, int end,
+    void (*fn)(int, int, int, void *), void *arg) {
+  struct editorTask tasks[CERAMIC_MAX_THREADS];
+  pthread_t threads[CERAMIC_MAX_THREADS];
+  int started[CERAMIC_MAX_THREADS];
+
+  if (nchunks > CERAMIC_MAX_THREADS)
+    nchunks = CERAMIC_MAX_THREADS;
+  if (nchunks < 1)
+    nchunks = 1;
+
+  long total = end - start;
+  int i;
+  for (i = 0; i < nchunks; i++) {
+    tasks[i].fn = fn;
+    tasks[i].chunk = i;
+    tasks[i].start = start + total * i / nchunks;
+    tasks[i].end = start + total * (i + 1) / nchunks;
+    tasks[i].arg = arg;
+    started[i] = 0;
+  }
+
+  for (i = 1; i < nchunks; i++)
+    started[i] = pthread_create(&threads[i], NULL, editorTaskRun,
+        &tasks[i]) == 0;
+  editorTaskRun(&tasks[0]);
+  for (i = 1; i < nchunks; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      editorTaskRun(&tasks[i]);
+  }
+}
+
+/* Editor Operations */
+
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorInsertRow (E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+void editorDeleteChar() {
+  if (E.cy == E.numrows || (E.cx == 0 && E.cy == 0)) {
+    return;
+  }
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    // Take out every byte of a multibyte character
+    int start = editorRowPrevChar(row, E.cx);
+    while (E.cx > start)
+      editorRowDeleteChar(row, --(E.cx));
+  }
+  else {
+    E.cx = E.row[--E.cy].size;
+    editorRowAppendString(&E.row[E.cy], row->chars, row->size);
+    editorDeleteRow(E.cy+1);
+  }
+}
+
+/* Doc: editorComplete
+ ----------------------------------------------
+ * Completes the word before the cursor from
+ *     the word index
+ *
+ * * matches come in sorted order, each Ctrl-N
+ * *     swaps in the next one and the typed
+ * *     prefix comes back after the last
+ * * the next match is picked by rank through
+ * *     the subtree counts, so the cost only
+ * *     depends on word length, never on the
+ * *     size of the buffer
+ *
+ ----------------------------------------------*/
+void editorComplete() {
+  if (E.cy >= E.numrows)
+    return;
+  erow *row = &E.row[E.cy];
+
+  // Anything but another Ctrl-N in between starts over from the cursor
+  if (E.comp_dirty != E.dirty || E.comp_row != E.cy ||
+      E.cx != E.comp_start + E.comp_len) {
+    int start = editorWordStart(row, E.cx);
+    int length = E.cx - start;
+    if (length == 0 || length > CERAMIC_WORD_MAX) {
+      editorSetStatusMessage("No word to complete");
+      return;
+    }
+    memcpy(E.comp_prefix, &row->chars[start], length);
+    E.comp_prefixlen = length;
+    E.comp_row = E.cy;
+    E.comp_start = start;
+    E.comp_len = length;
+  }
+
+  // The prefix itself, if it is a word, isn't a match
+  int node = editorWordFind(E.comp_prefix, E.comp_prefixlen);
+  int self = node && E.widx[node].count > 0;
+  int first = editorWordRank(E.comp_prefix, E.comp_prefixlen) + self;
+  int total = node ? E.widx[node].words - self : 0;
+  int cur = editorWordFind(&row->chars[E.comp_start], E.comp_len);
+  int next = editorWordRank(&row->chars[E.comp_start], E.comp_len) +
+      (cur && E.widx[cur].count > 0);
+
+  char word[CERAMIC_WORD_MAX];
+  int length = -1;
+  if (next < first + total)
+    length = editorWordSelect(next, word);
+  if (length == -1) {
+    memcpy(word, E.comp_prefix, E.comp_prefixlen);
+    length = E.comp_prefixlen;
+    if (E.comp_len == length)
+      editorSetStatusMessage("No completions%s", editorWordsPending() ?
+          " yet, still indexing" : "");
+    else
+      editorSetStatusMessage("Back at original");
+  }
+  else {
+    editorSetStatusMessage("Match %d of %d", next - first + 1, total);
+  }
+
+  editorRowReplace(row, E.comp_start, E.comp_len, word, length);
+  E.cx = E.comp_start + length;
+  E.comp_len = length;
+  E.comp_dirty = E.dirty;
+}
+
+/* Registers */
+
+void editorRegisterClear(struct editorRegister *reg) {
+  int j;
+  for (j = 0; j < reg->numrows; j++)
+    editorFreeRow(&reg->rows[j]);
+  free(reg->rows);
+  reg->rows = NULL;
+  reg->numrows = 0;
+}
+
+// Shares rows [at, at + count) into reg, without copying their contents
+void editorYankRows(struct editorRegister *reg, int at, int count) {
+  editorRegisterClear(reg);
+  if (count <= 0)
+    return;
+  reg->rows = malloc(sizeof(erow) * count);
+  int j;
+  for (j = 0; j < count; j++)
+    reg->rows[j] = editorShareRow(&E.row[at + j]);
+  reg->numrows = count;
+}
+
+void editorDeleteRows(struct editorRegister *reg, int at, int count) {
+  editorYankRows(reg, at, count);
+  editorSpliceRows(at, count, NULL, 0);
+}
+
+// Splices the rows of reg in before row at, in one move of the buffer
+void editorPutRows(struct editorRegister *reg, int at) {
+  if (reg->numrows == 0)
+    return;
+  erow *rows = malloc(sizeof(erow) * reg->numrows);
+  int j;
+  for (j = 0; j < reg->numrows; j++)
+    rows[j] = editorShareRow(&reg->rows[j]);
+  editorSpliceRows(at, 0, rows, reg->numrows);
+  free(rows);
+}
+
+void editorVisualRange(int *start, int *end) {
+  int last = E.cy < E.numrows ? E.cy : E.numrows - 1;
+  *start = E.vstart < last ? E.vstart : last;
+  *end = E.vstart < last ? last : E.vstart;
+}
+
+int editorInVisual(int at) {
+  if (E.mode != VISUAL)
+    return 0;
+  int start, end;
+  editorVisualRange(&start, &end);
+  return at >= start && at <= end;
+}
+
+void editorVisualOperator(int key) {
+  int start, end;
+  editorVisualRange(&start, &end);
+  int count = end - start + 1;
+  if (start < 0 || count <= 0)
+    return;
+
+  if (key == 'y') {
+    editorYankRows(&E.reg, start, count);
+    editorSetStatusMessage("%d lines yanked", count);
+  }
   else {
-    E.cx = E.row[--E.cy].size;
-    editorRowAppendString(&E.row[E.cy], row->chars, row->size);
-    editorDeleteRow(E.cy+1);
+    editorDeleteRows(&E.reg, start, count);
+    editorSetStatusMessage("%d fewer lines", count);
+  }
+  E.mode = NORMAL;
+  E.cy = start < E.numrows ? start : E.numrows;
+  E.cx = 0;
+  E.r_mov = 1;
+}
+
+void editorPut(int before) {
+  if (E.reg.numrows == 0) {
+    editorSetStatusMessage("Nothing to put");
+    return;
+  }
+  int at = E.cy;
+  if (!before && at < E.numrows)
+    at++;
+  editorPutRows(&E.reg, at);
+  E.cy = at;
+  E.cx = 0;
+  E.r_mov = 1;
+  editorSetStatusMessage("%d more lines", E.reg.numrows);
+}
+
+/* Subprocesses */
+
+/* Runs argv with its stdin and stdout on the given descriptors and stderr
+ * on /dev/null, so it can't scribble over the screen. Returns the pid, or
+ * -1 with errno set when the program can't be started. */
+pid_t editorSpawn(char *const argv[], int infd, int outfd) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t sigs;
+  pid_t pid;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, infd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+  posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+      O_WRONLY, 0);
+
+  // The editor ignores SIGPIPE, the child shouldn't
+  posix_spawnattr_init(&attr);
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+  int err = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+
+// Tries each argv in turn until one starts
+pid_t editorSpawnFirst(char *argvs[][4], int infd, int outfd) {
+  pid_t pid = -1;
+  int i;
+  for (i = 0; i < 3 && argvs[i][0]; i++) {
+    pid = editorSpawn(argvs[i], infd, outfd);
+    if (pid != -1)
+      break;
+  }
+  return pid;
+}
+
+int editorWaitChild(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      return -1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Asks the child to stop and reaps it, giving it CERAMIC_KILL_WAIT_MS to
+ * go before it is killed, so one that ignores SIGTERM can't hang us */
+void editorKillChild(pid_t pid) {
+  kill(pid, SIGTERM);
+  long deadline = editorNow() + CERAMIC_KILL_WAIT_MS;
+  while (editorNow() < deadline) {
+    pid_t r = waitpid(pid, NULL, WNOHANG);
+    if (r == pid || (r == -1 && errno != EINTR))
+      return;
+    struct timespec ts = {0, 10 * 1000000};
+    nanosleep(&ts, NULL);
+  }
+  kill(pid, SIGKILL);
+  editorWaitChild(pid);
+}
+
+/* Filters */
+
+/* Doc: editorFilterStart
+ ----------------------------------------------
+ * Pipes rows [at, at + count) through a shell
+ *     command read from the prompt
+ *
+ * * both pipes are non-blocking and driven
+ * *     from the poll in editorWaitForKey, so
+ * *     the editor stays responsive however
+ * *     long the command takes
+ * * the rows aren't copied, they are written
+ * *     out as they sit in E.row, which is why
+ * *     edits are held off until it's done
+ *
+ ----------------------------------------------*/
+void editorFilterStart(int at, int count) {
+  struct editorFilter *f = &E.filter;
+  if (f->pid)
+    return;
+  if (E.stream_fd != -1) {
+    editorSetStatusMessage("Still reading input, can't filter yet");
+    return;
+  }
+
+  char *cmd = editorPrompt("Filter through: %s", NULL);
+  if (cmd == NULL) {
+    editorSetStatusMessage("Filter canceled");
+    return;
+  }
+
+  int inpipe[2], outpipe[2];
+  if (pipe2(inpipe, O_CLOEXEC) == -1) {
+    free(cmd);
+    editorSetStatusMessage("Can't filter: %s", strerror(errno));
+    return;
+  }
+  if (pipe2(outpipe, O_CLOEXEC) == -1) {
+    close(inpipe[0]);
+    close(inpipe[1]);
+    free(cmd);
+    editorSetStatusMessage("Can't filter: %s", strerror(errno));
+    return;
+  }
+
+  char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+  pid_t pid = editorSpawn(argv, inpipe[0], outpipe[1]);
+  int err = errno;
+  close(inpipe[0]);
+  close(outpipe[1]);
+  free(cmd);
+  if (pid == -1) {
+    close(inpipe[1]);
+    close(outpipe[0]);
+    editorSetStatusMessage("Can't filter: %s", strerror(err));
+    return;
+  }
+
+  fcntl(inpipe[1], F_SETFL, fcntl(inpipe[1], F_GETFL) | O_NONBLOCK);
+  fcntl(outpipe[0], F_SETFL, fcntl(outpipe[0], F_GETFL) | O_NONBLOCK);
+
+  f->pid = pid;
+  f->in = inpipe[1];
+  f->out = outpipe[0];
+  f->at = at;
+  f->count = count;
+  f->row = at;
+  f->off = 0;
+  f->numrows = 0;
+  f->linelen = 0;
+  f->drawn = editorNow();
+
+  if (count == 0) {
+    close(f->in);
+    f->in = -1;
+  }
+  editorSetStatusMessage("Filtering %d lines (ESC to cancel)", count);
+}
+
+void editorFilterCloseInput() {
+  if (E.filter.in != -1) {
+    close(E.filter.in);
+    E.filter.in = -1;
+  }
+}
+
+/* Writes as much of the range as the pipe takes, a row and its newline
+ * per pair of iovecs */
+void editorFilterWrite() {
+  static char newline = '\n';
+  struct editorFilter *f = &E.filter;
+  struct iovec iov[CERAMIC_FILTER_IOV];
+  int end = f->at + f->count;
+  int writes = CERAMIC_STREAM_READS;
+
+  while (writes-- && f->row < end) {
+    int n = 0;
+    int j = f->row;
+    int off = f->off;
+    while (n + 2 <= CERAMIC_FILTER_IOV && j < end) {
+      if (off < E.row[j].size) {
+        iov[n].iov_base = &E.row[j].chars[off];
+        iov[n].iov_len = E.row[j].size - off;
+        n++;
+      }
+      iov[n].iov_base = &newline;
+      iov[n].iov_len = 1;
+      n++;
+      off = 0;
+      j++;
+    }
+
+    ssize_t w = writev(f->in, iov, n);
+    if (w == -1) {
+      if (errno == EAGAIN || errno == EINTR)
+        return;
+      // EPIPE, the command quit without reading everything
+      break;
+    }
+    while (w > 0) {
+      size_t left = E.row[f->row].size - f->off + 1;
+      if ((size_t)w >= left) {
+        w -= left;
+        f->row++;
+        f->off = 0;
+      }
+      else {
+        f->off += w;
+        w = 0;
+      }
+    }
+  }
+
+  if (writes < 0 && f->row < end)
+    return;
+  editorFilterCloseInput();
+}
+
+void editorFilterAppendRow(char *s, size_t length) {
+  struct editorFilter *f = &E.filter;
+  if (f->numrows == f->rowcap) {
+    f->rowcap = f->rowcap ? f->rowcap * 2 : 64;
+    f->rows = realloc(f->rows, sizeof(erow) * f->rowcap);
+    if (f->rows == NULL)
+      die("realloc");
+  }
+  editorInitRow(&f->rows[f->numrows++], s, length);
+}
+
+/* Reaps the command and either splices its output over the range or, when
+ * it failed or was canceled, throws the output away */
+void editorFilterFinish(int cancel) {
+  struct editorFilter *f = &E.filter;
+  editorFilterCloseInput();
+  close(f->out);
+  f->out = -1;
+  int status = -1;
+  if (cancel)
+    editorKillChild(f->pid);
+  else
+    status = editorWaitChild(f->pid);
+  f->pid = 0;
+
+  if (!cancel && f->linelen)
+    editorFilterAppendRow(f->line, f->linelen);
+  f->linelen = 0;
+
+  int j;
+  if (cancel || status != 0) {
+    for (j = 0; j < f->numrows; j++)
+      editorFreeRow(&f->rows[j]);
+    if (cancel)
+      editorSetStatusMessage("Filter canceled");
+    else
+      editorSetStatusMessage("Filter failed (exit status %d), buffer "
+          "left as it was", status);
+  }
+  else {
+    editorSpliceRows(f->at, f->count, f->rows, f->numrows);
+    E.cy = f->at < E.numrows ? f->at : E.numrows;
+    E.cx = 0;
+    E.r_mov = 1;
+    editorSetStatusMessage("%d lines filtered into %d", f->count,
+        f->numrows);
+  }
+
+  free(f->rows);
+  f->rows = NULL;
+  f->numrows = f->rowcap = 0;
+  free(f->line);
+  f->line = NULL;
+  f->linecap = 0;
+  editorRefreshScreen();
+}
+
+void editorFilterCancel() {
+  if (E.filter.pid)
+    editorFilterFinish(1);
+}
+
+/* Parses whatever the command has written so far into rows, keeping only
+ * an unfinished last line between calls */
+void editorFilterRead() {
+  static char buf[CERAMIC_STREAM_CHUNK];
+  struct editorFilter *f = &E.filter;
+  int reads = CERAMIC_STREAM_READS;
+
+  while (reads--) {
+    ssize_t n = read(f->out, buf, sizeof(buf));
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR)
+        break;
+      int err = errno;
+      editorFilterFinish(1);
+      editorSetStatusMessage("Filter read error: %s", strerror(err));
+      return;
+    }
+    if (n == 0) {
+      editorFilterFinish(0);
+      return;
+    }
+
+    char *p = buf;
+    char *end = buf + n;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      size_t len = (nl ? nl : end) - p;
+      if (f->linelen || nl == NULL) {
+        size_t need = f->linelen + len;
+        if (need > f->linecap) {
+          f->linecap = need * 2;
+          f->line = realloc(f->line, f->linecap);
+        }
+        memcpy(&f->line[f->linelen], p, len);
+        f->linelen = need;
+        if (nl) {
+          editorFilterAppendRow(f->line, f->linelen);
+          f->linelen = 0;
+        }
+      }
+      else {
+        editorFilterAppendRow(p, len);
+      }
+      p += len + 1;
+    }
+  }
+
+  long now = editorNow();
+  if (now - f->drawn >= CERAMIC_STREAM_REDRAW_MS) {
+    f->drawn = now;
+    editorSetStatusMessage("Filtering: %d of %d lines sent, %d back "
+        "(ESC to cancel)", f->row - f->at, f->count, f->numrows);
+    editorRefreshScreen();
+  }
+}
+
+/* Line index */
+
+/* Doc: struct editorIndexHeader
+ ----------------------------------------------
+ * Start of a line index sidecar, followed by
+ *     a uint64_t mark for every
+ *     CERAMIC_INDEX_STRIDE-th line, the offset
+ *     it starts at, in the byte order of the
+ *     machine that wrote it
+ *
+ * * the lines between two marks are found
+ * *     while their rows are built, which
+ * *     reads those bytes anyway, so a few
+ * *     bytes per thousand lines are all the
+ * *     sidecar needs
+ *
+ * * size, mtime and hash describe the bytes of
+ * *     the file the offsets cover; hash is
+ * *     taken from samples of them, see
+ * *     editorIndexHash
+ * * a file that has only grown since keeps
+ * *     its index, only the tail is scanned
+ *
+ ----------------------------------------------*/
+struct editorIndexHeader {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t hash;
+  uint64_t nlines;
+};
+
+// The sidecar for dir/name is dir/.name.cidx
+char *editorIndexPath(const char *filename) {
+  const char *base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+  size_t len = dirlen + strlen(base) + 7;
+  char *path = malloc(len);
+  snprintf(path, len, "%.*s.%s.cidx", dirlen, filename, base);
+  return path;
+}
+
+/* Hashes CERAMIC_INDEX_SAMPLES evenly spread blocks of map[0, size), plus
+ * the block just before size, so a prefix can be checked without reading
+ * all of it */
+uint64_t editorIndexHash(const char *map, uint64_t size) {
+  uint64_t h = size;
+  int i;
+  for (i = 0; i <= CERAMIC_INDEX_SAMPLES; i++) {
+    uint64_t off = i < CERAMIC_INDEX_SAMPLES ?
+        size / CERAMIC_INDEX_SAMPLES * i :
+        (size > CERAMIC_INDEX_SAMPLE_SIZE ? size - CERAMIC_INDEX_SAMPLE_SIZE : 0);
+    uint64_t len = size - off < CERAMIC_INDEX_SAMPLE_SIZE ?
+        size - off : CERAMIC_INDEX_SAMPLE_SIZE;
+    h = h * 1099511628211ULL ^ editorHashBytes(&map[off], len);
+  }
+  return h;
+}
+
+struct editorIndexScanJob {
+  const char *map;
+  uint64_t from;
+  uint64_t size;
+  int nchunks;
+  uint64_t *found[CERAMIC_MAX_THREADS];
+  uint64_t numfound[CERAMIC_MAX_THREADS];
+};
+
+void editorIndexScanChunk(int chunk, int start, int end, void *arg) {
+  struct editorIndexScanJob *job = arg;
+  (void) start;
+  (void) end;
+  uint64_t total = job->size - job->from;
+  const char *p = job->map + job->from + total * chunk / job->nchunks;
+  const char *stop = job->map + job->from + total * (chunk + 1) / job->nchunks;
+  uint64_t cap = 0, n = 0;
+  uint64_t *found = NULL;
+
+  const char *nl;
+  while (p < stop && (nl = memchr(p, '\n', stop - p)) != NULL) {
+    uint64_t next = nl + 1 - job->map;
+    if (next < job->size) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 4096;
+        found = realloc(found, sizeof(uint64_t) * cap);
+        if (found == NULL)
+          die("realloc");
+      }
+      found[n++] = next;
+    }
+    p = nl + 1;
+  }
+  job->found[chunk] = found;
+  job->numfound[chunk] = n;
+}
+
+/* Appends the start of every line in map[from, size) to *offsets, from
+ * itself included. Large spans are split across threads. */
+void editorIndexScan(const char *map, uint64_t from, uint64_t size,
+    uint64_t **offsets, uint64_t *nlines) {
+  if (from >= size)
+    return;
+
+  struct editorIndexScanJob job;
+  job.map = map;
+  job.from = from;
+  job.size = size;
+  // A short appended tail isn't worth starting threads for
+  job.nchunks = size - from >= CERAMIC_INDEX_MIN_SIZE ?
+      editorThreadCount(CERAMIC_PARALLEL_MIN_ROWS) : 1;
+  editorParallelFor(job.nchunks, 0, job.nchunks, editorIndexScanChunk, &job);
+
+  uint64_t total = *nlines + 1;
+  int i;
+  for (i = 0; i < job.nchunks; i++)
+    total += job.numfound[i];
+  *offsets = realloc(*offsets, sizeof(uint64_t) * total);
+  if (*offsets == NULL)
+    die("realloc");
+
+  (*offsets)[(*nlines)++] = from;
+  for (i = 0; i < job.nchunks; i++) {
+    memcpy(&(*offsets)[*nlines], job.found[i],
+        sizeof(uint64_t) * job.numfound[i]);
+    *nlines += job.numfound[i];
+    free(job.found[i]);
+  }
+}
+
+/* Scans map[from, size) and appends a mark for every
+ * CERAMIC_INDEX_STRIDE-th line in it to *marks. from has to start line
+ * *nlines, which is a multiple of the stride. */
+void editorIndexExtend(const char *map, uint64_t from, uint64_t size,
+    uint64_t **marks, uint64_t *nlines) {
+  uint64_t *offsets = NULL;
+  uint64_t n = 0;
+  editorIndexScan(map, from, size, &offsets, &n);
+
+  uint64_t total = *nlines + n;
+  *marks = realloc(*marks, sizeof(uint64_t) *
+      ((total + CERAMIC_INDEX_STRIDE - 1) / CERAMIC_INDEX_STRIDE + 1));
+  if (*marks == NULL)
+    die("realloc");
+  uint64_t j;
+  for (j = 0; j < n; j += CERAMIC_INDEX_STRIDE)
+    (*marks)[(*nlines + j) / CERAMIC_INDEX_STRIDE] = offsets[j];
+  *nlines = total;
+  free(offsets);
+}
+
+/* Maps the sidecar for filename and, if it still describes a prefix of
+ * map, copies out the marks of the blocks that are known to be complete.
+ * Returns how many bytes they cover, 0 when there is nothing usable. */
+uint64_t editorIndexRead(const char *filename, const char *map,
+    uint64_t size, uint64_t **marks, uint64_t *nlines, int *exact,
+    struct stat *st) {
+  char *path = editorIndexPath(filename);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd == -1)
+    return 0;
+
+  struct stat ist;
+  struct editorIndexHeader *h = MAP_FAILED;
+  if (fstat(fd, &ist) == 0 &&
+      (uint64_t) ist.st_size >= sizeof(struct editorIndexHeader))
+    h = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED)
+    return 0;
+
+  uint64_t covered = 0;
+  uint64_t nmarks = (h->nlines + CERAMIC_INDEX_STRIDE - 1) /
+      CERAMIC_INDEX_STRIDE;
+  if (memcmp(h->magic, CERAMIC_INDEX_MAGIC, 8) == 0 && h->size <= size &&
+      h->nlines > 0 && (uint64_t) ist.st_size ==
+      sizeof(*h) + nmarks * sizeof(uint64_t) &&
+      editorIndexHash(map, h->size) == h->hash) {
+    const uint64_t *offs = (const uint64_t *) (h + 1);
+    *exact = h->size == size && h->mtime_sec == st->st_mtim.tv_sec &&
+        h->mtime_nsec == st->st_mtim.tv_nsec;
+
+    /* The samples only say the prefix probably didn't change, so the
+     * marks at least have to start lines still. The loader checks the
+     * lines in between. */
+    uint64_t i;
+    int valid = offs[0] == 0;
+    for (i = 1; valid && i < nmarks; i++)
+      valid = offs[i] > offs[i - 1] && offs[i] < h->size &&
+          map[offs[i] - 1] == '\n';
+
+    // The last block may have grown since, it gets scanned again
+    uint64_t keep = *exact ? nmarks : nmarks - 1;
+    if (valid && keep > 0) {
+      *marks = malloc(sizeof(uint64_t) * (keep + 1));
+      if (*marks == NULL)
+        die("malloc");
+      memcpy(*marks, offs, sizeof(uint64_t) * keep);
+      *nlines = *exact ? h->nlines : keep * CERAMIC_INDEX_STRIDE;
+      covered = *exact ? h->size : offs[keep];
+    }
+    else {
+      *exact = 0;
+    }
+  }
+  munmap(h, ist.st_size);
+  return covered;
+}
+
+// Best effort, a directory we can't write to just means no sidecar
+int editorIndexWrite(const char *filename, const char *map, uint64_t size,
+    struct stat *st, uint64_t *marks, uint64_t nlines) {
+  char *path = editorIndexPath(filename);
+  size_t tmplen = strlen(path) + 5;
+  char *tmp = malloc(tmplen);
+  snprintf(tmp, tmplen, "%s.tmp", path);
+
+  struct editorIndexHeader h;
+  memcpy(h.magic, CERAMIC_INDEX_MAGIC, 8);
+  h.size = size;
+  h.mtime_sec = st->st_mtim.tv_sec;
+  h.mtime_nsec = st->st_mtim.tv_nsec;
+  h.hash = editorIndexHash(map, size);
+  h.nlines = nlines;
+  uint64_t nmarks = (nlines + CERAMIC_INDEX_STRIDE - 1) /
+      CERAMIC_INDEX_STRIDE;
+
+  int ok = 0;
+  FILE *fp = fopen(tmp, "w");
+  if (fp) {
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+        fwrite(marks, sizeof(uint64_t), nmarks, fp) == nmarks;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) == -1) {
+      unlink(tmp);
+      ok = 0;
+    }
+  }
+  free(tmp);
+  free(path);
+  return ok ? 0 : -1;
+}
+
+struct editorIndexLoadJob {
+  const char *map;
+  uint64_t size;
+  uint64_t *marks;
+  uint64_t nmarks;
+  int nlines;
+  int bad[CERAMIC_MAX_THREADS];
+};
+
+/* Builds the rows of blocks [start, end), walking from each mark to the
+ * next. Every row gets filled in even when the lines don't add up, so
+ * the caller can free them all before falling back to a full scan. */
+void editorIndexLoadChunk(int chunk, int start, int end, void *arg) {
+  struct editorIndexLoadJob *job = arg;
+  job->bad[chunk] = 0;
+  int b;
+  for (b = start; b < end; b++) {
+    const char *p = job->map + job->marks[b];
+    const char *stop = job->map + (b + 1 < (int) job->nmarks ?
+        job->marks[b + 1] : job->size);
+    int i = b * CERAMIC_INDEX_STRIDE;
+    int last = i + CERAMIC_INDEX_STRIDE < job->nlines ?
+        i + CERAMIC_INDEX_STRIDE : job->nlines;
+    for (; i < last; i++) {
+      const char *nl = p < stop ? memchr(p, '\n', stop - p) : NULL;
+      const char *to = nl ? nl : stop;
+      // Only the last line of the file can go without a newline
+      if (nl == NULL && (i + 1 < job->nlines || p == stop))
+        job->bad[chunk] = 1;
+      while (to > p && to[-1] == '\r')
+        to--;
+      // E.numrows is still 0, so this doesn't touch any editor state
+      editorInitRow(&E.row[i], p, to - p);
+      p = nl ? nl + 1 : stop;
+    }
+    if (p != stop)
+      job->bad[chunk] = 1;
+  }
+}
+
+// Builds E.row from the marks, returns -1 if they don't match the file
+int editorIndexLoad(const char *map, uint64_t size, uint64_t *marks,
+    uint64_t nlines) {
+  struct editorIndexLoadJob job;
+  job.map = map;
+  job.size = size;
+  job.marks = marks;
+  job.nmarks = (nlines + CERAMIC_INDEX_STRIDE - 1) / CERAMIC_INDEX_STRIDE;
+  job.nlines = nlines;
+  editorReserveRows(job.nlines);
+  int nchunks = editorThreadCount(job.nlines);
+  if (nchunks > (int) job.nmarks)
+    nchunks = job.nmarks;
+  editorParallelFor(nchunks, 0, job.nmarks, editorIndexLoadChunk, &job);
+
+  int i;
+  for (i = 0; i < nchunks; i++) {
+    if (job.bad[i]) {
+      for (i = 0; i < job.nlines; i++)
+        editorFreeRow(&E.row[i]);
+      return -1;
+    }
+  }
+  E.numrows = job.nlines;
+  editorSyntaxShift(0, 0, job.nlines);
+  editorWrapInvalidate(0);
+  return 0;
+}
+
+/* Doc: editorOpenIndexed
+ ----------------------------------------------
+ * Loads a large plain file straight from a
+ *     mapping of it
+ *
+ * * a sidecar index of line marks, if there
+ * *     is one, spares the scan for line
+ * *     breaks; only a tail appended since it
+ * *     was written is scanned, and the
+ * *     sidecar is rewritten to cover it
+ * * sidecars are opt-in, :index writes one,
+ * *     so nothing is left next to a file
+ * *     unless asked for
+ * * with the marks known, rows are built
+ * *     from the mapped file on all cores
+ * * returns -1 when the file isn't suitable,
+ * *     so editorOpen reads it line by line
+ * * the editor keeps every row in memory, so
+ * *     this speeds up loading rather than
+ * *     making it lazy
+ *
+ ----------------------------------------------*/
+int editorOpenIndexed(const char *filename, FILE *fp) {
+  struct stat st;
+  int fd = fileno(fp);
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size < CERAMIC_INDEX_MIN_SIZE)
+    return -1;
+
+  uint64_t size = st.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  char *path = editorIndexPath(filename);
+  int sidecar = access(path, F_OK) == 0;
+  free(path);
+
+  uint64_t *marks = NULL;
+  uint64_t nlines = 0;
+  int exact = 0;
+  uint64_t covered = sidecar ? editorIndexRead(filename, map, size, &marks,
+      &nlines, &exact, &st) : 0;
+  if (!exact)
+    editorIndexExtend(map, covered, size, &marks, &nlines);
+
+  int ret = -1;
+  if (nlines <= (uint64_t) INT_MAX) {
+    ret = editorIndexLoad(map, size, marks, nlines);
+    if (ret == -1 && covered) {
+      // The sidecar was wrong about the lines it kept, start over
+      nlines = 0;
+      covered = 0;
+      exact = 0;
+      editorIndexExtend(map, 0, size, &marks, &nlines);
+      ret = editorIndexLoad(map, size, marks, nlines);
+    }
+  }
+  if (ret == 0 && sidecar && !exact)
+    editorIndexWrite(filename, map, size, &st, marks, nlines);
+
+  free(marks);
+  munmap(map, size);
+  return ret;
+}
+
+/* Writes a sidecar for the file being edited, as it is on disk, or with
+ * remove set deletes it. Large files with a sidecar keep it up to date
+ * whenever they are opened. */
+void editorIndexCommand(int remove) {
+  if (E.filename == NULL || E.compression) {
+    editorSetStatusMessage("Only plain files can be indexed");
+    return;
+  }
+  char *path = editorIndexPath(E.filename);
+  if (remove) {
+    if (unlink(path) == 0)
+      editorSetStatusMessage("Removed %s", path);
+    else
+      editorSetStatusMessage("Can't remove %s: %s", path, strerror(errno));
+    free(path);
+    return;
+  }
+
+  int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  char *map = MAP_FAILED;
+  if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd != -1)
+    close(fd);
+  if (map == MAP_FAILED) {
+    editorSetStatusMessage("Can't index %s", E.filename);
+    free(path);
+    return;
+  }
+
+  uint64_t *marks = NULL;
+  uint64_t nlines = 0;
+  editorIndexExtend(map, 0, st.st_size, &marks, &nlines);
+  if (editorIndexWrite(E.filename, map, st.st_size, &st, marks, nlines)
+      == 0)
+    editorSetStatusMessage("Indexed %llu lines into %s",
+        (unsigned long long) nlines, path);
+  else
+    editorSetStatusMessage("Can't write %s: %s", path, strerror(errno));
+  free(marks);
+  munmap(map, st.st_size);
+  free(path);
+}
+
+/* File I/O */
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    totlen += E.row[j].size + 1;
+  }
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+
+  for (j = 0; j < E.numrows; j++) {
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  // buf has to be freed
+  return buf;
+}
+
+struct editorCompression *editorDetectCompression(FILE *fp) {
+  char magic[4];
+  size_t n = fread(magic, 1, sizeof(magic), fp);
+  rewind(fp);
+
+  unsigned int i;
+  for (i = 0; i < CDB_ENTRIES; i++) {
+    if (n >= (size_t) CDB[i].magiclen &&
+        memcmp(magic, CDB[i].magic, CDB[i].magiclen) == 0)
+      return &CDB[i];
+  }
+  return NULL;
+}
+
+/* Starts the decoder for E.compression on fp and streams its output into
+ * the buffer the same way stdin is read, so rows show up as they are
+ * decompressed and nothing touches the disk. */
+void editorOpenCompressed(FILE *fp) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) == -1)
+    die("pipe");
+
+  pid_t pid = editorSpawnFirst(E.compression->decoders, fileno(fp),
+      pipefd[1]);
+  close(pipefd[1]);
+  if (pid == -1) {
+    close(pipefd[0]);
+    editorSetStatusMessage("Can't start %s decoder: %s",
+        E.compression->name, strerror(errno));
+    return;
+  }
+
+  editorOpenStream(pipefd[0]);
+  E.stream_pid = pid;
+}
+
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+  editorCsvSelect();
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    die("fopen");
+
+  E.compression = editorDetectCompression(fp);
+  if (E.compression) {
+    editorOpenCompressed(fp);
+    fclose(fp);
+    E.dirty = 0;
+    editorRecordFileStat();
+    return;
+  }
+
+  if (editorOpenIndexed(filename, fp) == 0) {
+    fclose(fp);
+    E.dirty = 0;
+    editorRecordFileStat();
+    return;
+  }
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
   }
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+  editorRecordFileStat();
+}
+
+/* External changes */
+
+void editorRecordFileStat() {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1)
+    return;
+  E.file_size = st.st_size;
+  E.file_mtime = st.st_mtim;
+  E.file_changed = 0;
+}
+
+int editorFileChangedOnDisk() {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1)
+    return 0;
+  return st.st_size != E.file_size ||
+         st.st_mtim.tv_sec != E.file_mtime.tv_sec ||
+         st.st_mtim.tv_nsec != E.file_mtime.tv_nsec;
+}
+
+struct lineHash {
+  uint64_t hash;
+  int size;
+  off_t off;
+  // Row of the old middle the line is matched to, or -1
+  int match;
+};
+
+// A distinct line of the old middle, and how often it shows up on each side
+struct reloadSlot {
+  uint64_t hash;
+  int size;
+  int oldcount;
+  int old;
+  int newcount;
+};
+
+struct reloadSlot *editorReloadSlot(struct reloadSlot *slots, int mask,
+    uint64_t hash, int size) {
+  int k = hash & mask;
+  while (slots[k].oldcount &&
+         (slots[k].hash != hash || slots[k].size != size))
+    k = (k + 1) & mask;
+  return &slots[k];
 }
 
-/* File I/O */
+/* Doc: editorReloadMatch
+ ----------------------------------------------
+ * Pairs the new middle lines up with the old
+ *     middle rows [at, at + count), setting
+ *     match on every line that can keep its
+ *     row
+ *
+ * * lines found exactly once on both sides
+ * *     are anchors; the longest run of them
+ * *     that is in order on both sides is
+ * *     kept, like patience diff does
+ * * equal lines next to anchors are matched
+ * *     as well, so runs of blank lines and
+ * *     braces between them stay put
+ *
+ ----------------------------------------------*/
+void editorReloadMatch(struct lineHash *lines, int nlines, int at,
+    int count) {
+  int i, j;
+  for (j = 0; j < nlines; j++)
+    lines[j].match = -1;
+  if (count == 0 || nlines == 0)
+    return;
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1;
+  int cap = 16;
+  while (cap < count * 2)
+    cap *= 2;
+  struct reloadSlot *slots = calloc(cap, sizeof(struct reloadSlot));
+  for (i = 0; i < count; i++) {
+    erow *row = &E.row[at + i];
+    struct reloadSlot *s = editorReloadSlot(slots, cap - 1, row->hash,
+        row->size);
+    s->hash = row->hash;
+    s->size = row->size;
+    s->oldcount++;
+    s->old = i;
   }
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
 
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+  // Candidates, in new order, get the old row they'd keep in cand
+  int *cand = malloc(sizeof(int) * nlines);
+  int *candline = malloc(sizeof(int) * nlines);
+  int ncand = 0;
+  for (j = 0; j < nlines; j++) {
+    struct reloadSlot *s = editorReloadSlot(slots, cap - 1, lines[j].hash,
+        lines[j].size);
+    if (s->oldcount)
+      s->newcount++;
+  }
+  for (j = 0; j < nlines; j++) {
+    struct reloadSlot *s = editorReloadSlot(slots, cap - 1, lines[j].hash,
+        lines[j].size);
+    if (s->oldcount == 1 && s->newcount == 1) {
+      cand[ncand] = s->old;
+      candline[ncand++] = j;
+    }
+  }
+  free(slots);
+
+  // Longest increasing run of old rows among them
+  int *top = malloc(sizeof(int) * (ncand + 1));
+  int *prev = malloc(sizeof(int) * (ncand + 1));
+  int len = 0;
+  int c;
+  for (c = 0; c < ncand; c++) {
+    int lo = 0, hi = len;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (cand[top[mid]] < cand[c])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    prev[c] = lo ? top[lo - 1] : -1;
+    top[lo] = c;
+    if (lo == len)
+      len++;
+  }
+  for (c = len ? top[len - 1] : -1; c != -1; c = prev[c])
+    lines[candline[c]].match = cand[c];
+  free(top);
+  free(prev);
+  free(cand);
+  free(candline);
+
+  // Grow the matches into the gaps between anchors from both ends
+  int pj = -1, pi = -1;
+  for (j = 0; j <= nlines; j++) {
+    if (j < nlines && lines[j].match == -1)
+      continue;
+    int ni = j < nlines ? lines[j].match : count;
+    int fj = pj + 1, fi = pi + 1;
+    while (fj < j && fi < ni && lines[fj].hash == E.row[at + fi].hash &&
+           lines[fj].size == E.row[at + fi].size) {
+      lines[fj].match = fi;
+      fj++;
+      fi++;
+    }
+    int bj = j - 1, bi = ni - 1;
+    while (bj >= fj && bi >= fi && lines[bj].hash == E.row[at + bi].hash &&
+           lines[bj].size == E.row[at + bi].size) {
+      lines[bj].match = bi;
+      bj--;
+      bi--;
+    }
+    pj = j;
+    pi = ni;
   }
-
-  // buf has to be freed
-  return buf;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+/* Doc: editorReload
+ ----------------------------------------------
+ * Brings the buffer in line with the file on
+ *     disk, touching only the rows that differ
+ *
+ * * the file is read once, hashing each line
+ * * the common prefix is matched against the
+ * *     row hashes while reading, then the
+ * *     common suffix from the collected
+ * *     hashes
+ * * lines in between are matched to the old
+ * *     rows by editorReloadMatch; matched
+ * *     ones share the old row's buffers and
+ * *     only the others are read again
+ * * the middle is replaced in one splice
+ * * cursor and scroll are kept, following
+ * *     their row when it was matched
+ *
+ ----------------------------------------------*/
+void editorReload() {
+  FILE *fp = fopen(E.filename, "r");
+  if (!fp) {
+    editorSetStatusMessage("Can't reload %.20s: %s", E.filename,
+        strerror(errno));
+    return;
+  }
 
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
 
+  int prefix = 0;
+  int diverged = 0;
+  struct lineHash *tail = NULL;
+  int tailcount = 0, tailcap = 0;
+
+  off_t off = 0;
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    off_t next = off + linelen;
     while (linelen > 0 && (line[linelen - 1] == '\n' ||
                            line[linelen - 1] == '\r'))
       linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+    uint64_t h = editorHashBytes(line, linelen);
+
+    if (!diverged) {
+      if (prefix < E.numrows && E.row[prefix].size == linelen &&
+          E.row[prefix].hash == h) {
+        prefix++;
+        off = next;
+        continue;
+      }
+      diverged = 1;
+    }
+
+    if (tailcount == tailcap) {
+      tailcap = tailcap ? tailcap * 2 : 64;
+      tail = realloc(tail, sizeof(struct lineHash) * tailcap);
+    }
+    tail[tailcount].hash = h;
+    tail[tailcount].size = linelen;
+    tail[tailcount].off = off;
+    tailcount++;
+    off = next;
+  }
+
+  int suffix = 0;
+  while (suffix < tailcount && suffix < E.numrows - prefix) {
+    struct lineHash *lh = &tail[tailcount - 1 - suffix];
+    erow *row = &E.row[E.numrows - 1 - suffix];
+    if (row->size != lh->size || row->hash != lh->hash)
+      break;
+    suffix++;
+  }
+
+  int delcount = E.numrows - prefix - suffix;
+  int inscount = tailcount - suffix;
+  editorReloadMatch(tail, inscount, prefix, delcount);
+
+  erow *rows = NULL;
+  int *moved = NULL;
+  int reread = 0;
+  if (delcount > 0) {
+    moved = malloc(sizeof(int) * delcount);
+    int i;
+    for (i = 0; i < delcount; i++)
+      moved[i] = -1;
   }
+  if (inscount > 0) {
+    rows = malloc(sizeof(erow) * inscount);
+    off_t pos = -1;
+    int j;
+    for (j = 0; j < inscount; j++) {
+      if (tail[j].match != -1) {
+        rows[j] = editorShareRow(&E.row[prefix + tail[j].match]);
+        moved[tail[j].match] = j;
+        continue;
+      }
+      if (pos != tail[j].off)
+        fseeko(fp, tail[j].off, SEEK_SET);
+      linelen = getline(&line, &linecap, fp);
+      if (linelen == -1)
+        break;
+      pos = tail[j].off + linelen;
+      while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                             line[linelen - 1] == '\r'))
+        linelen--;
+      editorInitRow(&rows[j], line, linelen);
+      reread++;
+    }
+    // The file changed again under us; keep what was read
+    inscount = j;
+  }
+  free(tail);
   free(line);
   fclose(fp);
+
+  /* Rows that were matched carry the cursor and the scroll position
+   * along; anything else in the middle keeps its place as well as it can */
+  int cy = E.cy, rowoff = E.rowoff;
+  int shift = inscount - delcount;
+  if (cy >= prefix + delcount)
+    cy += shift;
+  else if (cy >= prefix && moved[cy - prefix] != -1 &&
+           moved[cy - prefix] < inscount)
+    cy = prefix + moved[cy - prefix];
+  else if (cy >= prefix + inscount)
+    cy = prefix + (inscount ? inscount - 1 : 0);
+  if (rowoff >= prefix + delcount)
+    rowoff += shift;
+  else if (rowoff >= prefix && moved[rowoff - prefix] != -1 &&
+           moved[rowoff - prefix] < inscount)
+    rowoff = prefix + moved[rowoff - prefix];
+  free(moved);
+
+  if (delcount || inscount)
+    editorSpliceRows(prefix, delcount, rows, inscount);
+  free(rows);
+
+  E.cy = cy;
+  E.rowoff = rowoff;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.rowoff > E.cy)
+    E.rowoff = E.cy;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx > rowlen)
+    E.cx = rowlen;
+
   E.dirty = 0;
+  editorRecordFileStat();
+  editorSetStatusMessage("%.20s changed on disk, reloaded %d lines",
+      E.filename, reread);
+}
+
+void editorCheckFileChange() {
+  time_t now = time(NULL);
+  if (E.filename == NULL || E.file_changed || E.stream_fd != -1 ||
+      E.filter.pid || E.prompting ||
+      now - E.file_checked < CERAMIC_WATCH_INTERVAL)
+    return;
+  E.file_checked = now;
+
+  if (!editorFileChangedOnDisk())
+    return;
+
+  // Compressed files can't be diffed line by line without decoding them
+  if (E.dirty || E.compression) {
+    E.file_changed = 1;
+    editorSetStatusMessage("Warning: %.20s changed on disk", E.filename);
+  }
+  else {
+    editorReload();
+  }
+  editorRefreshScreen();
+}
+
+/* Streaming input */
+
+// Milliseconds on a monotonic clock, for rate limiting
+long editorNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Moves the data on stdin out of the way and puts the terminal back on
+ * STDIN_FILENO, so the rest of the editor can keep reading keys from it.
+ * Returns the descriptor the data can be read from. */
+int editorReopenTty() {
+  int fd = dup(STDIN_FILENO);
+  if (fd == -1)
+    die("dup");
+  int tty = open("/dev/tty", O_RDWR);
+  if (tty == -1)
+    die("open /dev/tty");
+  if (dup2(tty, STDIN_FILENO) == -1)
+    die("dup2");
+  close(tty);
+  return fd;
+}
+
+void editorOpenStream(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    die("fcntl");
+  E.stream_fd = fd;
+  E.stream_linelen = 0;
+  E.stream_drawn = 0;
+}
+
+void editorStreamAppendRow(char *s, size_t length) {
+  while (length > 0 && s[length - 1] == '\r')
+    length--;
+  editorInsertRow(E.numrows, s, length);
+}
+
+void editorCloseStream() {
+  if (E.stream_linelen)
+    editorStreamAppendRow(E.stream_line, E.stream_linelen);
+  free(E.stream_line);
+  E.stream_line = NULL;
+  E.stream_linelen = E.stream_linecap = 0;
+  close(E.stream_fd);
+  E.stream_fd = -1;
+
+  if (E.stream_pid) {
+    if (editorWaitChild(E.stream_pid) != 0)
+      editorSetStatusMessage("Warning: %s decoder failed, file may be "
+          "incomplete", E.compression ? E.compression->name : "stream");
+    E.stream_pid = 0;
+  }
+}
+
+/* Doc: editorStreamRead
+ ----------------------------------------------
+ * Turns whatever is waiting on stream_fd into
+ *     rows at the end of the buffer
+ *
+ * * reads at most CERAMIC_STREAM_READS chunks
+ * *     of CERAMIC_STREAM_CHUNK bytes, then
+ * *     returns so pending keys get handled
+ * * only the unfinished last line is kept
+ * *     between calls
+ * * redraws at most every
+ * *     CERAMIC_STREAM_REDRAW_MS, and once
+ * *     more when the stream ends
+ *
+ ----------------------------------------------*/
+void editorStreamRead() {
+  static char buf[CERAMIC_STREAM_CHUNK];
+  int dirty = E.dirty;
+  int reads = CERAMIC_STREAM_READS;
+  int ended = 0;
+
+  while (reads--) {
+    ssize_t n = read(E.stream_fd, buf, sizeof(buf));
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR)
+        break;
+      editorSetStatusMessage("Read error: %s", strerror(errno));
+      ended = 1;
+      break;
+    }
+    if (n == 0) {
+      ended = 1;
+      break;
+    }
+
+    char *p = buf;
+    char *end = buf + n;
+    char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      if (E.stream_linelen) {
+        size_t need = E.stream_linelen + (nl - p);
+        if (need > E.stream_linecap) {
+          E.stream_linecap = need * 2;
+          E.stream_line = realloc(E.stream_line, E.stream_linecap);
+        }
+        memcpy(&E.stream_line[E.stream_linelen], p, nl - p);
+        editorStreamAppendRow(E.stream_line, need);
+        E.stream_linelen = 0;
+      }
+      else {
+        editorStreamAppendRow(p, nl - p);
+      }
+      p = nl + 1;
+    }
+
+    if (p < end) {
+      size_t need = E.stream_linelen + (end - p);
+      if (need > E.stream_linecap) {
+        E.stream_linecap = need * 2;
+        E.stream_line = realloc(E.stream_line, E.stream_linecap);
+      }
+      memcpy(&E.stream_line[E.stream_linelen], p, end - p);
+      E.stream_linelen = need;
+    }
+  }
+
+  if (ended)
+    editorCloseStream();
+  E.dirty = dirty;
+
+  long now = editorNow();
+  if (ended || now - E.stream_drawn >= CERAMIC_STREAM_REDRAW_MS) {
+    E.stream_drawn = now;
+    editorRefreshScreen();
+  }
+}
+
+/* Pipes buf through the encoder for E.compression into fd. Returns 0 on
+ * success. */
+int editorWriteCompressed(int fd, char *buf, int len) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) == -1)
+    return -1;
+
+  pid_t pid = editorSpawnFirst(E.compression->encoders, pipefd[0], fd);
+  close(pipefd[0]);
+  if (pid == -1) {
+    close(pipefd[1]);
+    return -1;
+  }
+
+  int done = 0;
+  while (done < len) {
+    ssize_t n = write(pipefd[1], buf + done, len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+  close(pipefd[1]);
+
+  int status = editorWaitChild(pid);
+  if (done < len || status != 0) {
+    if (status != 0)
+      errno = EIO;
+    return -1;
+  }
+  return 0;
 }
 
 void editorSave() {
+  if (E.stream_fd != -1) {
+    editorSetStatusMessage("Still reading input, can't save yet");
+    return;
+  }
+
   if(E.filename == NULL) {
     E.filename = editorPrompt("Save as: %s", NULL);
     if(E.filename == NULL) {
       editorSetStatusMessage("Save canceled");
       return;
     }
+    editorSelectSyntaxHighlight();
+    editorCsvSelect();
+  }
+  else if (editorFileChangedOnDisk() &&
+      editorConfirm("File changed on disk since it was read. "
+                    "Overwrite? (y/n)") != 1) {
+    editorSetStatusMessage("Save canceled");
+    return;
+  }
+
+  int compress = 0;
+  if (E.compression) {
+    char msg[80];
+    snprintf(msg, sizeof(msg), "Re-compress as %s? (y/n)",
+        E.compression->name);
+    compress = editorConfirm(msg);
+    if (compress == -1) {
+      editorSetStatusMessage("Save canceled");
+      return;
+    }
   }
 
   int len;
   char *buf = editorRowsToString(&len);
 
+  /* The encoder writes to a file next to the real one, which is only
+   * replaced once the encoder has succeeded */
+  if (compress) {
+    size_t tmplen = strlen(E.filename) + 8;
+    char *tmp = malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.XXXXXX", E.filename);
+
+    // mkstemp makes the file 0600, give it the mode open would have
+    struct stat st;
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd != -1) {
+      if (stat(E.filename, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+      }
+      else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0644 & ~mask);
+      }
+    }
+    int ok = fd != -1 && editorWriteCompressed(fd, buf, len) == 0;
+    if (fd != -1 && close(fd) == -1)
+      ok = 0;
+    if (ok && rename(tmp, E.filename) == 0) {
+      free(tmp);
+      free(buf);
+      editorSetStatusMessage("%d bytes written to %.20s (%s)", len,
+          E.filename, E.compression->name);
+      E.dirty = 0;
+      editorRecordFileStat();
+      return;
+    }
+    int err = errno;
+    if (fd != -1)
+      unlink(tmp);
+    free(tmp);
+    free(buf);
+    editorSetStatusMessage("Can't save! I/O Error: %s", strerror(err));
+    return;
+  }
+
   int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
 
   //Write file out, checking for errors
@@ -540,6 +4308,9 @@ void editorSave() {
         free(buf);
         editorSetStatusMessage("%d bytes written to %.20s", len, E.filename);
         E.dirty = 0;
+        // The file is plain text now, so don't offer to compress it again
+        E.compression = NULL;
+        editorRecordFileStat();
         return;
       }
     }
@@ -561,53 +4332,631 @@ void editorFindCallback(char *query, int key) {
   else if (key == ARROW_RIGHT) {
     direction = 1;
   }
-  else if (key == ARROW_LEFT) {
-    direction = 1;
+  else if (key == ARROW_LEFT) {
+    direction = 1;
+  }
+  else {
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1)
+    direction = 1;
+  int curr = last_match;
+
+  int i;
+  for (i = 0; i < E.numrows; i++) {
+    curr += direction;
+    if (curr == -1)
+      curr = E.numrows - 1;
+    else if (curr == E.numrows)
+      curr = 0;
+
+    erow *row = &E.row[curr];
+    char *match = strstr(row->chars, query);
+    if (match) {
+      last_match = curr;
+      E.cy = curr;
+      E.cx = match - row->chars;
+      E.rowoff = E.numrows;
+      break;
+    }
+  }
+}
+
+void editorFind() {
+  int saved_c_x = E.cx;
+  int saved_c_y = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+  char *query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
+
+  if (query)
+    free(query);
+  else {
+    E.cx = saved_c_x;
+    E.cy = saved_c_y;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+/* Search and replace */
+
+/* Returns a copy of row's chars with every occurrence of query starting in
+ * [from, to) replaced, or NULL if there is none. The number of
+ * replacements goes in *count. */
+char *editorRowReplaceAll(erow *row, int from, int to, const char *query,
+    int qlen, const char *with, int wlen, int *newsize, int *count) {
+  int n = 0;
+  char *p = row->chars + from;
+  char *end = row->chars + row->size;
+  char *stop = row->chars + to;
+  char *m;
+  while ((m = memmem(p, end - p, query, qlen)) != NULL && m < stop) {
+    n++;
+    p = m + qlen;
+  }
+  *count = n;
+  if (n == 0)
+    return NULL;
+
+  int size = row->size + n * (wlen - qlen);
+  char *buf = editorBufAlloc(size + 1);
+  char *out = buf;
+  memcpy(out, row->chars, from);
+  out += from;
+  p = row->chars + from;
+  while ((m = memmem(p, end - p, query, qlen)) != NULL && m < stop) {
+    memcpy(out, p, m - p);
+    out += m - p;
+    memcpy(out, with, wlen);
+    out += wlen;
+    p = m + qlen;
+  }
+  memcpy(out, p, end - p);
+  buf[size] = '\0';
+  *newsize = size;
+  return buf;
+}
+
+// Old contents of a row replace-all changed, for the word index
+struct editorReplaced {
+  int at;
+  char *chars;
+  int size;
+};
+
+struct editorReplaceJob {
+  const char *query;
+  int qlen;
+  const char *with;
+  int wlen;
+  // Per chunk results
+  long count[CERAMIC_MAX_THREADS];
+  int first[CERAMIC_MAX_THREADS];
+  int last[CERAMIC_MAX_THREADS];
+  struct editorReplaced *old[CERAMIC_MAX_THREADS];
+  int numold[CERAMIC_MAX_THREADS];
+};
+
+void editorReplaceChunk(int chunk, int start, int end, void *arg) {
+  struct editorReplaceJob *job = arg;
+  long count = 0;
+  int first = -1, last = -1;
+  int oldcap = 0;
+  job->old[chunk] = NULL;
+  job->numold[chunk] = 0;
+
+  int i;
+  for (i = start; i < end; i++) {
+    erow *row = &E.row[i];
+    int n, size;
+    char *buf = editorRowReplaceAll(row, 0, row->size, job->query, job->qlen,
+        job->with, job->wlen, &size, &n);
+    if (buf == NULL)
+      continue;
+
+    // The trie isn't thread safe, indexed rows are fixed up afterwards
+    if (i < E.widx_built) {
+      if (job->numold[chunk] == oldcap) {
+        oldcap = oldcap ? oldcap * 2 : 64;
+        job->old[chunk] = realloc(job->old[chunk],
+            sizeof(struct editorReplaced) * oldcap);
+      }
+      struct editorReplaced *old = &job->old[chunk][job->numold[chunk]++];
+      old->at = i;
+      old->chars = row->chars;
+      old->size = row->size;
+    }
+    else {
+      editorBufRelease(row->chars);
+    }
+    row->chars = buf;
+    row->size = size;
+    editorRenderRow(row);
+
+    count += n;
+    if (first == -1)
+      first = i;
+    last = i;
+  }
+
+  job->count[chunk] = count;
+  job->first[chunk] = first;
+  job->last[chunk] = last;
+}
+
+/* Doc: editorReplaceAll
+ ----------------------------------------------
+ * Replaces every occurrence of query in the
+ *     buffer in one pass
+ *
+ * * each affected row is rebuilt once, so its
+ * *     render and hash are recomputed once no
+ * *     matter how many matches it holds
+ * * large buffers are split across threads,
+ * *     the editor bookkeeping is done once for
+ * *     the changed span afterwards
+ * * returns the number of replacements
+ *
+ ----------------------------------------------*/
+long editorReplaceAll(const char *query, const char *with) {
+  struct editorReplaceJob job;
+  job.query = query;
+  job.qlen = strlen(query);
+  job.with = with;
+  job.wlen = strlen(with);
+
+  int nchunks = editorThreadCount(E.numrows);
+  editorParallelFor(nchunks, 0, E.numrows, editorReplaceChunk, &job);
+
+  long total = 0;
+  int first = -1, last = -1;
+  int i, j;
+  for (i = 0; i < nchunks; i++) {
+    for (j = 0; j < job.numold[i]; j++) {
+      struct editorReplaced *old = &job.old[i][j];
+      erow *row = &E.row[old->at];
+      editorWordsAdjust(old->chars, 0, old->size, -1);
+      editorWordsAdjust(row->chars, 0, row->size, 1);
+      editorBufRelease(old->chars);
+    }
+    free(job.old[i]);
+
+    if (job.count[i] == 0)
+      continue;
+    total += job.count[i];
+    if (first == -1)
+      first = job.first[i];
+    last = job.last[i];
+  }
+
+  if (total) {
+    editorSyntaxInvalidate(first, last - first + 1);
+    editorWrapInvalidate(first);
+    E.dirty++;
+  }
+  return total;
+}
+
+// Replaces the qlen characters at i in row with s
+void editorRowReplace(erow *row, int i, int qlen, const char *s, int slen) {
+  int start = editorWordStart(row, i);
+  int end = editorWordEnd(row, i + qlen);
+  editorWordsSpan(row, start, end, -1);
+  char *buf = editorBufAlloc(row->size - qlen + slen + 1);
+  memcpy(buf, row->chars, i);
+  memcpy(&buf[i], s, slen);
+  memcpy(&buf[i + slen], &row->chars[i + qlen], row->size - i - qlen + 1);
+  editorBufRelease(row->chars);
+  row->chars = buf;
+  row->size += slen - qlen;
+  editorWordsSpan(row, start, end + slen - qlen, 1);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/* Walks the matches of query from the cursor to the end of the buffer and
+ * around to where it started, asking about each one. After 'a' the matches
+ * left on the walk are replaced without asking. Returns the number of
+ * replacements made. */
+long editorReplaceInteractive(const char *query, const char *with) {
+  int qlen = strlen(query);
+  int wlen = strlen(with);
+  int start_row = E.cy < E.numrows ? E.cy : 0;
+  int start_col = E.cy < E.numrows ? E.cx : 0;
+  long count = 0;
+  int ask = 1;
+
+  int pass;
+  for (pass = 0; pass <= E.numrows; pass++) {
+    int r = (start_row + pass) % (E.numrows ? E.numrows : 1);
+    if (r >= E.numrows)
+      break;
+    int col = pass == 0 ? start_col : 0;
+    // The last pass comes back to the start row, up to where it started
+    int limit = pass == E.numrows ? start_col : -1;
+
+    while (ask) {
+      erow *row = &E.row[r];
+      if (col > row->size)
+        break;
+      char *m = memmem(&row->chars[col], row->size - col, query, qlen);
+      if (m == NULL)
+        break;
+      int at = m - row->chars;
+      if (limit != -1 && at >= limit)
+        break;
+
+      E.cy = r;
+      E.cx = at;
+      E.r_mov = 1;
+      editorSetStatusMessage("Replace this match? (y/n/a/q)");
+      editorRefreshScreen();
+
+      int c = editorReadKey();
+      // Streamed input or a reload may have moved or changed the rows
+      if (r >= E.numrows)
+        return count;
+      row = &E.row[r];
+      if (at + qlen > row->size || memcmp(&row->chars[at], query, qlen))
+        continue;
+
+      if (c == 'y' || c == 'Y') {
+        editorRowReplace(row, at, qlen, with, wlen);
+        count++;
+        col = at + wlen;
+      }
+      else if (c == 'n' || c == 'N') {
+        col = at + (qlen ? qlen : 1);
+      }
+      else if (c == 'a' || c == 'A') {
+        ask = 0;
+        col = at;
+      }
+      else if (c == 'q' || c == 'Q' || c == '\x1b') {
+        return count;
+      }
+    }
+
+    if (!ask) {
+      erow *row = &E.row[r];
+      int to = limit != -1 ? limit : row->size;
+      int n, size;
+      char *buf = col <= row->size ? editorRowReplaceAll(row, col, to,
+          query, qlen, with, wlen, &size, &n) : NULL;
+      if (buf) {
+        editorRowReplace(row, col, row->size - col, &buf[col], size - col);
+        editorBufRelease(buf);
+        count += n;
+      }
+    }
+  }
+  return count;
+}
+
+void editorReplace() {
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+  if (query == NULL)
+    return;
+  // Replacing with nothing deletes the matches
+  char *with = editorPromptInput("Replace with: %s (ESC to cancel)", NULL,
+      1);
+  if (with == NULL) {
+    free(query);
+    return;
+  }
+
+  long count = 0;
+  int all = editorConfirm("Replace all without asking? (y/n)");
+  if (all == 0)
+    count = editorReplaceInteractive(query, with);
+  else if (all == 1)
+    count = editorReplaceAll(query, with);
+
+  if (all != -1) {
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+      E.cx = E.row[E.cy].size;
+    editorSetStatusMessage("%ld replacement%s", count, count == 1 ? "" : "s");
+  }
+  free(query);
+  free(with);
+}
+
+/* Sort and uniq */
+
+struct editorSortOptions {
+  int numeric;
+  int reverse;
+  int unique;
+  int key;
+};
+
+/* Doc: struct editorSortHandle
+ ----------------------------------------------
+ * Stands in for a row while sorting
+ *
+ * * key points into the row's chars, nothing
+ * *     is copied
+ * * at is where the row was, it breaks ties
+ * *     so the sort is stable
+ *
+ ----------------------------------------------*/
+struct editorSortHandle {
+  const char *key;
+  double num;
+  int keylen;
+  int at;
+};
+
+struct editorSortJob {
+  struct editorSortOptions *opts;
+  int at;
+  struct editorSortHandle *src;
+  struct editorSortHandle *dst;
+  int runs[CERAMIC_MAX_THREADS + 1];
+  int numruns;
+};
+
+// Points h at field opts->key (1 based, blank separated) to end of line
+void editorSortKey(struct editorSortHandle *h, erow *row,
+    struct editorSortOptions *opts) {
+  const char *p = row->chars;
+  const char *end = row->chars + row->size;
+  int field;
+  for (field = 1; field < opts->key; field++) {
+    while (p < end && isblank((unsigned char) *p))
+      p++;
+    while (p < end && !isblank((unsigned char) *p))
+      p++;
+  }
+  if (opts->key > 1) {
+    while (p < end && isblank((unsigned char) *p))
+      p++;
+  }
+  h->key = p;
+  h->keylen = end - p;
+  // chars is NUL terminated, so strtod can't run off the row
+  h->num = opts->numeric ? strtod(p, NULL) : 0;
+}
+
+// Compares keys only, 0 means the rows count as duplicates
+int editorSortKeyCompare(const struct editorSortHandle *x,
+    const struct editorSortHandle *y, struct editorSortOptions *opts) {
+  int r;
+  if (opts->numeric) {
+    r = (x->num > y->num) - (x->num < y->num);
   }
   else {
-    last_match = -1;
-    direction = 1;
+    int len = x->keylen < y->keylen ? x->keylen : y->keylen;
+    r = memcmp(x->key, y->key, len);
+    if (r == 0)
+      r = (x->keylen > y->keylen) - (x->keylen < y->keylen);
   }
+  return opts->reverse ? -r : r;
+}
 
-  if (last_match == -1)
-    direction = 1;
-  int curr = last_match;
+int editorSortCompare(const void *a, const void *b, void *arg) {
+  const struct editorSortHandle *x = a;
+  const struct editorSortHandle *y = b;
+  int r = editorSortKeyCompare(x, y, arg);
+  if (r == 0)
+    r = (x->at > y->at) - (x->at < y->at);
+  return r;
+}
 
+void editorSortChunk(int chunk, int start, int end, void *arg) {
+  struct editorSortJob *job = arg;
   int i;
-  for (i = 0; i < E.numrows; i++) {
-    curr += direction;
-    if (curr == -1)
-      curr = E.numrows - 1;
-    else if (curr == E.numrows)
-      curr = 0;
+  for (i = start; i < end; i++) {
+    job->src[i].at = i;
+    editorSortKey(&job->src[i], &E.row[job->at + i], job->opts);
+  }
+  qsort_r(&job->src[start], end - start, sizeof(struct editorSortHandle),
+      editorSortCompare, job->opts);
+  job->runs[chunk] = start;
+}
 
-    erow *row = &E.row[curr];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = curr;
-      E.cy = curr;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-      break;
+// Merges runs 2 * pair and 2 * pair + 1 of src into dst
+void editorSortMerge(int chunk, int start, int end, void *arg) {
+  struct editorSortJob *job = arg;
+  (void) chunk;
+  int pair;
+  for (pair = start; pair < end; pair++) {
+    // runs[numruns] is the end of the last run, an odd one out is copied
+    int r = pair * 2;
+    int i = job->runs[r];
+    int mid = job->runs[r + 1];
+    int last = r + 2 <= job->numruns ? job->runs[r + 2] : mid;
+    int j = mid;
+    int k = i;
+    while (i < mid && j < last) {
+      if (editorSortCompare(&job->src[j], &job->src[i], job->opts) < 0)
+        job->dst[k++] = job->src[j++];
+      else
+        job->dst[k++] = job->src[i++];
     }
+    memcpy(&job->dst[k], &job->src[i], sizeof(*job->dst) * (mid - i));
+    k += mid - i;
+    memcpy(&job->dst[k], &job->src[j], sizeof(*job->dst) * (last - j));
   }
 }
 
-void editorFind() {
-  int saved_c_x = E.cx;
-  int saved_c_y = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
-  char *query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
+/* Doc: editorSortRows
+ ----------------------------------------------
+ * Sorts rows [at, at + count), dropping rows
+ *     whose keys repeat when unique is set
+ *
+ * * only handles are sorted: each chunk of
+ * *     rows gets its keys found and sorted on
+ * *     its own thread, then the sorted runs
+ * *     are merged pairwise, in parallel too
+ * * the rows themselves are moved into place
+ * *     by following the cycles of the
+ * *     permutation, so no second copy of the
+ * *     erow array is ever made
+ * * with sort set to 0 the rows keep their
+ * *     order, which is how uniq works
+ * * returns the number of rows dropped
+ *
+ ----------------------------------------------*/
+int editorSortRows(int at, int count, struct editorSortOptions *opts,
+    int sort) {
+  if (count <= 1)
+    return 0;
 
-  if (query)
-    free(query);
+  struct editorSortJob job;
+  job.opts = opts;
+  job.at = at;
+  job.src = malloc(sizeof(struct editorSortHandle) * count);
+  job.dst = malloc(sizeof(struct editorSortHandle) * count);
+  if (job.src == NULL || job.dst == NULL)
+    die("malloc");
+
+  int i;
+  if (sort) {
+    job.numruns = editorThreadCount(count);
+    editorParallelFor(job.numruns, 0, count, editorSortChunk, &job);
+    job.runs[job.numruns] = count;
+    while (job.numruns > 1) {
+      int pairs = (job.numruns + 1) / 2;
+      editorParallelFor(pairs, 0, pairs, editorSortMerge, &job);
+      struct editorSortHandle *tmp = job.src;
+      job.src = job.dst;
+      job.dst = tmp;
+      for (i = 0; i < pairs; i++)
+        job.runs[i] = job.runs[i * 2];
+      job.runs[pairs] = count;
+      job.numruns = pairs;
+    }
+  }
   else {
-    E.cx = saved_c_x;
-    E.cy = saved_c_y;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    for (i = 0; i < count; i++) {
+      job.src[i].at = i;
+      editorSortKey(&job.src[i], &E.row[at + i], opts);
+    }
+  }
+
+  // Kept rows go first, repeats after them so one splice drops them all
+  int kept = 0, dropped = 0;
+  for (i = 0; i < count; i++) {
+    if (opts->unique && kept &&
+        editorSortKeyCompare(&job.src[i], &job.dst[kept - 1], opts) == 0)
+      job.src[dropped++] = job.src[i];
+    else
+      job.dst[kept++] = job.src[i];
+  }
+  memcpy(&job.dst[kept], job.src, sizeof(*job.dst) * dropped);
+
+  // perm[k] is the row that ends up at k
+  int *perm = (int *) job.src;
+  for (i = 0; i < count; i++)
+    perm[i] = job.dst[i].at;
+  free(job.dst);
+
+  erow *base = &E.row[at];
+  for (i = 0; i < count; i++) {
+    if (perm[i] == i)
+      continue;
+    erow tmp = base[i];
+    int j = i;
+    while (perm[j] != i) {
+      int next = perm[j];
+      base[j] = base[next];
+      perm[j] = j;
+      j = next;
+    }
+    base[j] = tmp;
+    perm[j] = j;
+  }
+  free(perm);
+
+  /* The rows keep the hl_open of where they used to be, so the row below
+   * has to be lexed again too before re-lexing can call it settled */
+  editorSyntaxInvalidate(at, count + 1);
+  editorFoldShift(at, count, count);
+  editorWrapInvalidate(at);
+  if (dropped)
+    editorSpliceRows(at + kept, dropped, NULL, 0);
+  else
+    E.dirty++;
+  return dropped;
+}
+
+/* Runs sort or uniq over rows [at, at + count). Options are single letters,
+ * optionally after a '-': n numeric, r reverse, u unique, kN key from field
+ * N on. */
+void editorSortCommand(char *cmd, int at, int count) {
+  struct editorSortOptions opts = {0, 0, 0, 1};
+  int sort = strncmp(cmd, "sort", 4) == 0;
+  char *p = cmd + 4;
+  opts.unique = !sort;
+
+  while (*p) {
+    if (*p == ' ' || *p == '-') {
+      p++;
+    }
+    else if (*p == 'n' && sort) {
+      opts.numeric = 1;
+      p++;
+    }
+    else if (*p == 'r' && sort) {
+      opts.reverse = 1;
+      p++;
+    }
+    else if (*p == 'u' && sort) {
+      opts.unique = 1;
+      p++;
+    }
+    else if (*p == 'k' && isdigit((unsigned char) p[1])) {
+      opts.key = strtol(p + 1, &p, 10);
+      if (opts.key < 1)
+        opts.key = 1;
+    }
+    else {
+      editorSetStatusMessage("Unknown option: %s", p);
+      return;
+    }
+  }
+
+  // Rows move around, so indexed rows can't be mixed with ones that aren't
+  if (at < E.widx_built && at + count > E.widx_built)
+    editorWordsDeleteRows(at, E.widx_built - at);
+
+  int dropped = editorSortRows(at, count, &opts, sort);
+  E.cy = at < E.numrows ? at : E.numrows;
+  E.cx = 0;
+  E.r_mov = 1;
+  if (sort)
+    editorSetStatusMessage("%d lines sorted, %d dropped", count, dropped);
+  else
+    editorSetStatusMessage("%d repeated lines dropped", dropped);
+}
+
+// ':' prompt, over rows [at, at + count)
+void editorCommand(int at, int count) {
+  char *cmd = editorPrompt(":%s", NULL);
+  if (cmd == NULL)
+    return;
+
+  char *p = cmd;
+  while (*p == ' ')
+    p++;
+  if (strncmp(p, "sort", 4) == 0 || strncmp(p, "uniq", 4) == 0) {
+    editorSortCommand(p, at, count);
   }
+  else if (strcmp(p, "index") == 0 || strcmp(p, "noindex") == 0) {
+    editorIndexCommand(p[0] == 'n');
+  }
+  else if (strcmp(p, "csv") == 0 || strcmp(p, "tsv") == 0) {
+    int delim = p[0] == 'c' ? ',' : '\t';
+    editorCsvSet(E.csv == delim ? 0 : delim);
+    editorSetStatusMessage("Columnar view %s", E.csv ? "on" : "off");
+  }
+  else if (*p)
+    editorSetStatusMessage("Not a command: %s", p);
+  free(cmd);
 }
 
 /* Append Buffer */
@@ -615,33 +4964,79 @@ void editorFind() {
 struct abuf {
   char *b;
   int length;
+  int capacity;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
-void abAppend(struct abuf *ab, const char *s, int length) {
-  char *new = realloc(ab->b, ab->length + length);
-  memcpy(&new[ab->length], s, length);
+void abReserve(struct abuf *ab, int capacity) {
+  if (capacity <= ab->capacity)
+    return;
+  char *new = realloc(ab->b, capacity);
+  if (new == NULL)
+    die("realloc");
   ab->b = new;
-  ab->length += length;
+  ab->capacity = capacity;
 }
 
-void abFree(struct abuf *ab) {
-  free(ab->b);
+void abAppend(struct abuf *ab, const char *s, int length) {
+  if (ab->length + length > ab->capacity) {
+    int capacity = ab->capacity ? ab->capacity * 2 : 256;
+    while (capacity < ab->length + length)
+      capacity *= 2;
+    abReserve(ab, capacity);
+  }
+  memcpy(&ab->b[ab->length], s, length);
+  ab->length += length;
 }
 
 /* Output */
 
+/* Soft wrap counterpart of editorScroll: keeps the cursor's screen line
+ * between the top line and the bottom of the screen */
+void editorWrapScroll() {
+  editorWrapEnsure();
+  E.coloff = 0;
+
+  int cursor = editorWrapCursorLine();
+  int top = editorWrapPrefix(E.rowoff < E.numrows ? E.rowoff : E.numrows)
+      + E.wrapoff;
+  if (cursor < top)
+    top = cursor;
+  if (cursor >= top + E.screenrows)
+    top = cursor - E.screenrows + 1;
+  editorWrapFind(top, &E.rowoff, &E.wrapoff);
+}
+
 void editorScroll() {
   if (E.cy < E.numrows && E.r_mov) {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
 
+  editorFoldRevealCursor();
+
+  if (E.wrap) {
+    editorWrapScroll();
+    return;
+  }
+
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
   }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+  if (E.numfolds == 0) {
+    if (E.cy >= E.rowoff + E.screenrows) {
+      E.rowoff = E.cy - E.screenrows + 1;
+    }
+  }
+  else {
+    if (editorRowHidden(E.rowoff))
+      E.rowoff = E.folds[editorFoldFind(E.rowoff)].start;
+    if (editorVisibleBetween(E.rowoff, E.cy) >= E.screenrows) {
+      int i;
+      E.rowoff = E.cy;
+      for (i = 1; i < E.screenrows; i++)
+        E.rowoff = editorPrevVisibleRow(E.rowoff);
+    }
   }
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
@@ -651,10 +5046,161 @@ void editorScroll() {
   }
 }
 
+/* Appends s to ab as far as it falls inside screen columns [col, col +
+ * screencols), x being the column s starts at. Returns 0 once the right
+ * edge is reached. */
+int editorCsvPut(struct abuf *ab, int *x, int col, const char *s,
+    int length) {
+  int limit = col + E.screencols;
+  int j = 0;
+  while (j < length) {
+    uint32_t cp;
+    int n = editorUtf8Decode(&s[j], length - j, &cp);
+    int w = cp == '\t' ? 1 : editorCharWidth(cp);
+    if (*x + w > limit)
+      return 0;
+    if (*x >= col) {
+      if (cp == '\t')
+        abAppend(ab, " ", 1);
+      else
+        abAppend(ab, &s[j], n);
+    }
+    else if (*x + w > col) {
+      // Right half of a wide character
+      abAppend(ab, " ", 1);
+    }
+    *x += w;
+    j += n;
+  }
+  return 1;
+}
+
+int editorCsvPad(struct abuf *ab, int *x, int col, int count) {
+  static const char spaces[] = "                                ";
+  while (count > 0) {
+    int n = count < (int) sizeof(spaces) - 1 ? count :
+        (int) sizeof(spaces) - 1;
+    if (!editorCsvPut(ab, x, col, spaces, n))
+      return 0;
+    count -= n;
+  }
+  return 1;
+}
+
+// Draws row at with its fields lined up, starting from screen column col
+void editorCsvDrawRow(struct abuf *ab, int at, int col) {
+  erow *row = &E.row[at];
+  int x = 0;
+  int c = 0;
+  int i = 0;
+  while (1) {
+    int end = editorCsvFieldEnd(row, i);
+    int textw = editorCsvTextWidth(&row->chars[i], end - i);
+    int width = editorCsvColWidth(c, textw);
+
+    // Cut the field off at its column edge
+    int cut = end;
+    int used = textw;
+    if (textw > width) {
+      cut = i;
+      used = 0;
+      while (cut < end) {
+        uint32_t cp;
+        int n = editorUtf8Decode(&row->chars[cut], end - cut, &cp);
+        int w = cp == '\t' ? 1 : editorCharWidth(cp);
+        if (used + w > width)
+          break;
+        used += w;
+        cut += n;
+      }
+    }
+    if (!editorCsvPut(ab, &x, col, &row->chars[i], cut - i))
+      return;
+    if (end >= row->size)
+      return;
+    if (!editorCsvPad(ab, &x, col, width - used + CERAMIC_CSV_GAP))
+      return;
+    i = end + 1;
+    c++;
+  }
+}
+
+/* Appends one screen line of row at, starting at column col, switching
+ * colors only when they change */
+void editorDrawRow(struct abuf *ab, int at, int col) {
+  if (E.csv) {
+    editorCsvDrawRow(ab, at, col);
+    return;
+  }
+  erow *row = &E.row[at];
+  int start, lead;
+  int len = editorRenderSpan(row, col, E.screencols, &start, &lead);
+
+  while (lead--)
+    abAppend(ab, " ", 1);
+
+  if (E.syntax == NULL) {
+    abAppend(ab, &row->render[start], len);
+    return;
+  }
+
+  if (row->hl == NULL)
+    editorSyntaxHighlightRow(at);
+
+  char *c = &row->render[start];
+  unsigned char *hl = &row->hl[start];
+  int current_color = -1;
+  int run = 0;
+  int j;
+  for (j = 0; j < len; j++) {
+    int color = hl[j] == HL_NORMAL ? -1 : editorSyntaxToColor(hl[j]);
+    if (color != current_color) {
+      abAppend(ab, &c[run], j - run);
+      run = j;
+      if (color == -1) {
+        abAppend(ab, "\x1b[39m", 5);
+      }
+      else {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        abAppend(ab, buf, clen);
+      }
+      current_color = color;
+    }
+  }
+  abAppend(ab, &c[run], len - run);
+  if (current_color != -1)
+    abAppend(ab, "\x1b[39m", 5);
+}
+
+// Marker after a folded row, cut to the columns left on its line
+void editorDrawFoldMarker(struct abuf *ab, int at, int used) {
+  struct fold *f = &E.folds[editorFoldFind(at)];
+  char marker[48];
+  int len = snprintf(marker, sizeof(marker), " +-- %d lines", f->end - f->start);
+  if (used < 0)
+    used = 0;
+  if (len > E.screencols - used)
+    len = E.screencols - used;
+  if (len <= 0)
+    return;
+  abAppend(ab, "\x1b[7m", 4);
+  abAppend(ab, marker, len);
+  abAppend(ab, "\x1b[m", 3);
+}
+
 void editorDrawRows(struct abuf *ab) {
+  int last = E.rowoff;
   int i;
+  for (i = 1; i < E.screenrows && last < E.numrows; i++)
+    last = editorNextVisibleRow(last);
+  editorSyntaxUpdate(last, E.rowoff, last + 1);
+  if (E.csv)
+    editorCsvMeasure(E.rowoff, last + 1);
+
+  int filerow = E.rowoff;
+  int wrapline = E.wrapoff;
   for (i=0; i < E.screenrows; i++) {
-    int filerow = i + E.rowoff;
     if (filerow >= E.numrows) {
       if (E.numrows == 0 && i == E.screenrows / 3) {
         char welcome[80];
@@ -678,13 +5224,34 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     }
+    else if (E.wrap) {
+      int selected = editorInVisual(filerow);
+      if (selected)
+        abAppend(ab, "\x1b[7m", 4);
+      editorDrawRow(ab, filerow, wrapline * E.screencols);
+      if (selected)
+        abAppend(ab, "\x1b[m", 3);
+      if (++wrapline >= E.row[filerow].wraplines) {
+        if (editorRowFolded(filerow))
+          editorDrawFoldMarker(ab, filerow,
+              E.row[filerow].rwidth - wrapline * E.screencols + E.screencols);
+        filerow = editorNextVisibleRow(filerow);
+        wrapline = 0;
+      }
+    }
     else {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      int selected = editorInVisual(filerow);
+      if (selected)
+        abAppend(ab, "\x1b[7m", 4);
+      editorDrawRow(ab, filerow, E.coloff);
+      if (selected)
+        abAppend(ab, "\x1b[m", 3);
+      if (editorRowFolded(filerow)) {
+        erow *row = &E.row[filerow];
+        int width = E.csv ? editorCsvCxToRx(row, row->size) : row->rwidth;
+        editorDrawFoldMarker(ab, filerow, width - E.coloff);
+      }
+      filerow = editorNextVisibleRow(filerow);
     }
 
     abAppend(ab, "\x1b[K", 3);
@@ -695,11 +5262,15 @@ void editorDrawRows(struct abuf *ab) {
 void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  char rec[16] = "";
+  if (E.recording)
+    snprintf(rec, sizeof(rec), " recording @%c", E.recording);
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
       E.filename ? E.filename : "[No file]", E.numrows,
-      E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-      E.cy + 1, E.numrows);
+      E.stream_fd != -1 ? "(reading)" : E.filter.pid ? "(filtering)" :
+      E.dirty ? "(modified)" : "", rec);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
   if (len > E.screencols)
     len = E.screencols;
   abAppend(ab, status, len);
@@ -727,9 +5298,17 @@ void editorDrawMessageBar(struct abuf *ab) {
 }
 
 void editorRefreshScreen() {
+  // Macro playback paints once, when it's done
+  if (E.replay_depth)
+    return;
+
   editorScroll();
 
-  struct abuf ab = ABUF_INIT;
+  /* The frame buffer outlives the frame, it's only reallocated when a
+   * bigger window or unusually colourful frame needs more room */
+  static struct abuf ab = ABUF_INIT;
+  ab.length = 0;
+  abReserve(&ab, (E.screenrows + 2) * (E.screencols + 16));
 
   abAppend(&ab, "\x1b[?25l", 6);
   abAppend(&ab, "\x1b[H", 3);
@@ -739,15 +5318,31 @@ void editorRefreshScreen() {
   editorDrawMessageBar(&ab);
 
   char buf[32];
-  int rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (rx - E.coloff) + 1);
+  int rx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+  int y = editorVisibleBetween(E.rowoff, E.cy);
+  int x = rx - E.coloff;
+  if (E.wrap) {
+    y = editorWrapCursorLine() - editorWrapPrefix(E.rowoff) - E.wrapoff;
+    x = rx - (rx / E.screencols) * E.screencols;
+    if (E.cy < E.numrows && rx / E.screencols >= E.row[E.cy].wraplines)
+      x = E.screencols - 1;
+  }
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.length);
-  abFree(&ab);
+  // SIGWINCH doesn't restart syscalls, so a resize can cut the write short
+  int done = 0;
+  while (done < ab.length) {
+    ssize_t n = write(STDOUT_FILENO, ab.b + done, ab.length - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -765,12 +5360,22 @@ void editorClearStatusMessage() {
 /* Input Process */
 
 char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
+  return editorPromptInput(prompt, callback, 0);
+}
+
+// Like editorPrompt, but Enter on an empty line is accepted if empty is set
+char *editorPromptInput(char *prompt, void(*callback)(char *, int),
+    int empty) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
 
   size_t buflen = 0;
   buf[0] = '\0';
 
+  // The caller may already have picked rows the answer applies to
+  int prompting = E.prompting;
+  E.prompting = 1;
+
   while(1) {
     editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
@@ -784,12 +5389,14 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
       editorClearStatusMessage();
       if (callback) callback(buf, c);
       free(buf);
+      E.prompting = prompting;
       return NULL;
     }
     if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || empty) {
         editorClearStatusMessage();
         if (callback) callback(buf, c);
+        E.prompting = prompting;
         return buf;
       }
     }
@@ -806,6 +5413,107 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
   }
 }
 
+int editorConfirm(const char *prompt) {
+  while (1) {
+    editorSetStatusMessage("%s", prompt);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == 'y' || c == 'Y') {
+      editorClearStatusMessage();
+      return 1;
+    }
+    if (c == 'n' || c == 'N') {
+      editorClearStatusMessage();
+      return 0;
+    }
+    if (c == '\x1b') {
+      editorClearStatusMessage();
+      return -1;
+    }
+  }
+}
+
+// Background work run while waiting for a key
+void editorIdle() {
+  editorCheckFileChange();
+  editorWordsBuild();
+}
+
+/* Blocks until a key can be read from the terminal, feeding any open
+ * stream into the buffer while waiting */
+void editorWaitForKey() {
+  while (1) {
+    struct pollfd fds[5];
+    int nfds = 0;
+    int stream = -1, filter_in = -1, filter_out = -1;
+
+    fds[nfds].fd = STDIN_FILENO;
+    fds[nfds].events = POLLIN;
+    nfds++;
+    fds[nfds].fd = E.winch_fd[0];
+    fds[nfds].events = POLLIN;
+    nfds++;
+    if (E.stream_fd != -1) {
+      stream = nfds;
+      fds[nfds].fd = E.stream_fd;
+      fds[nfds].events = POLLIN;
+      nfds++;
+    }
+    if (E.filter.in != -1) {
+      filter_in = nfds;
+      fds[nfds].fd = E.filter.in;
+      fds[nfds].events = POLLOUT;
+      nfds++;
+    }
+    if (E.filter.out != -1) {
+      filter_out = nfds;
+      fds[nfds].fd = E.filter.out;
+      fds[nfds].events = POLLIN;
+      nfds++;
+    }
+
+    // Don't sleep while there is indexing left to do
+    int n = poll(fds, nfds, editorWordsPending() ? 0 :
+        CERAMIC_WATCH_INTERVAL * 1000);
+    if (n == -1 && errno != EINTR)
+      die("poll");
+
+    editorCheckResize();
+    if (n > 0 && stream != -1 && fds[stream].revents)
+      editorStreamRead();
+    if (n > 0 && filter_in != -1 && fds[filter_in].revents)
+      editorFilterWrite();
+    if (n > 0 && filter_out != -1 && fds[filter_out].revents)
+      editorFilterRead();
+    editorIdle();
+
+    if (n > 0 && fds[0].revents)
+      return;
+  }
+}
+
+/* Pages by screen lines rather than rows in soft wrap mode, leaving the
+ * cursor on the new top line */
+void editorWrapPage(int key) {
+  editorWrapEnsure();
+  int total = editorWrapTotal();
+  int top = editorWrapPrefix(E.rowoff < E.numrows ? E.rowoff : E.numrows)
+      + E.wrapoff;
+
+  top += (key == PAGE_UP) ? -E.screenrows : E.screenrows;
+  if (top > total - 1)
+    top = total - 1;
+  if (top < 0)
+    top = 0;
+
+  editorWrapFind(top, &E.rowoff, &E.wrapoff);
+  E.cy = E.rowoff;
+  E.cx = E.cy < E.numrows ?
+      editorRowRxToCx(&E.row[E.cy], E.wrapoff * E.screencols) : 0;
+  E.r_mov = 1;
+}
+
 void editorMoveCursor(int key) {
   erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
@@ -813,10 +5521,10 @@ void editorMoveCursor(int key) {
     case ARROW_LEFT:
     case 'h':
       if (E.cx != 0) {
-        E.cx--;
+        E.cx = row ? editorRowPrevChar(row, E.cx) : E.cx - 1;
       }
       else if (E.cy > 0 && E.mode == INSERT) {
-        E.cy--;
+        E.cy = editorPrevVisibleRow(E.cy);
         E.cx = E.row[E.cy].size;
       }
       E.r_mov = 1;
@@ -824,10 +5532,10 @@ void editorMoveCursor(int key) {
     case ARROW_RIGHT:
     case 'l':
       if (row && E.cx < row->size) {
-        E.cx++;
+        E.cx = editorRowNextChar(row, E.cx);
       }
       else if (row && E.cx == row->size && E.mode == INSERT) {
-        E.cy++;
+        E.cy = editorNextVisibleRow(E.cy);
         E.cx = 0;
       }
       E.r_mov = 1;
@@ -835,7 +5543,7 @@ void editorMoveCursor(int key) {
     case ARROW_UP:
     case 'k':
       if (E.cy != 0) {
-        E.cy--;
+        E.cy = editorPrevVisibleRow(E.cy);
         E.cx = editorRowRxToCx(&E.row[E.cy], E.rx);
         E.r_mov = 0;
       }
@@ -847,8 +5555,8 @@ void editorMoveCursor(int key) {
     case ARROW_DOWN:
     case 'j':
       if (E.cy < E.numrows) {
-        E.cy++;
-        E.cx = editorRowRxToCx(&E.row[E.cy], E.rx);
+        E.cy = editorNextVisibleRow(E.cy);
+        E.cx = E.cy < E.numrows ? editorRowRxToCx(&E.row[E.cy], E.rx) : 0;
         E.r_mov = 0;
       }
       break;
@@ -859,15 +5567,113 @@ void editorMoveCursor(int key) {
   if (E.cx >= rowlen) {
     E.cx = (E.mode == NORMAL) ? rowlen - 1 : rowlen;
   }
+  if (row && E.cx > 0)
+    E.cx = editorRowCharStart(row, E.cx);
+}
+
+/* Macros */
+
+void editorMacroRecord() {
+  int c = editorReadKey();
+  if (c < 'a' || c > 'z')
+    return;
+  E.macros[c - 'a'].length = 0;
+  E.recording = c;
+}
+
+void editorMacroStop() {
+  struct editorMacro *m = &E.macros[E.recording - 'a'];
+  // Drop the 'q' that stopped the recording
+  if (m->length > 0)
+    m->length--;
+  editorSetStatusMessage("Recorded %d keys into @%c", m->length,
+      E.recording);
+  E.recording = 0;
+}
+
+/* Doc: editorMacroPlay
+ ----------------------------------------------
+ * Runs a macro register times times
+ *
+ * * keys go straight into editorProcessKey,
+ * *     editorReadKey hands them out from the
+ * *     replay stack instead of the terminal
+ * * editorRefreshScreen does nothing while a
+ * *     macro plays, the main loop paints once
+ * *     when it's over
+ *
+ ----------------------------------------------*/
+void editorMacroPlay(int times) {
+  int c = editorReadKey();
+  if (c == '@')
+    c = E.last_macro;
+  if (c < 'a' || c > 'z')
+    return;
+  if (E.recording == c) {
+    editorSetStatusMessage("Can't play @%c while recording it", c);
+    return;
+  }
+  if (E.replay_depth == CERAMIC_MACRO_DEPTH) {
+    editorSetStatusMessage("Macros nested too deep");
+    return;
+  }
+  E.last_macro = c;
+
+  struct editorMacro *m = &E.macros[c - 'a'];
+  struct editorReplay *r = &E.replay[E.replay_depth++];
+  r->keys = m->keys;
+  r->length = m->length;
+
+  while (times--) {
+    r->pos = 0;
+    /* Nothing is drawn until the end, but the cursor column and scroll
+     * position still have to follow every key, as the next one may use
+     * them */
+    while (r->pos < r->length) {
+      editorProcessKey(editorReadKey());
+      editorScroll();
+    }
+  }
+  E.replay_depth--;
 }
 
 void editorProcessKeypress() {
+  editorProcessKey(editorReadKey());
+}
+
+void editorProcessKey(int c) {
   static int quit_times = CERAMIC_QUIT_TIMES;
-  int c = editorReadKey();
 
   // Clear Statusbar from modified file warning message
   editorClearStatusMessage();
 
+  // The filter reads straight from E.row, so only let the cursor move
+  if (E.filter.pid) {
+    switch (c) {
+      case '\x1b':
+        editorFilterCancel();
+        return;
+      case CTRL_KEY('q'):
+      case CTRL_KEY('w'):
+      case PAGE_UP:
+      case PAGE_DOWN:
+      case HOME_KEY:
+      case END_KEY:
+      case ARROW_LEFT:
+      case ARROW_RIGHT:
+      case ARROW_UP:
+      case ARROW_DOWN:
+      case 'h':
+      case 'j':
+      case 'k':
+      case 'l':
+        break;
+      default:
+        editorSetStatusMessage("Filter running, ESC to cancel");
+        return;
+    }
+  }
+
   // Universal hotkeys
   switch (c) {
     case CTRL_KEY('q'):
@@ -876,6 +5682,8 @@ void editorProcessKeypress() {
             "Press Ctrl-Q to exit without saving changes.");
         return;
       }
+      // Don't leave the filter command behind as a zombie
+      editorFilterCancel();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -899,15 +5707,26 @@ void editorProcessKeypress() {
     case CTRL_KEY('f'):
       editorFind();
       break;
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+    case CTRL_KEY('w'):
+      editorToggleWrap();
+      break;
+
     case PAGE_UP:
     case PAGE_DOWN:
-      {
+      if (E.wrap) {
+        editorWrapPage(c);
+      }
+      else {
         if(c == PAGE_UP)
           E.cy = E.rowoff;
         else if (c == PAGE_DOWN) {
-          E.cy = E.rowoff + E.screenrows - 1;
-          if (E.cy > E.numrows)
-           E.cy = E.numrows;
+          int times = E.screenrows - 1;
+          E.cy = E.rowoff;
+          while (times-- && E.cy < E.numrows)
+            E.cy = editorNextVisibleRow(E.cy);
         }
         int times = E.screenrows;
         while (times--)
@@ -919,6 +5738,44 @@ void editorProcessKeypress() {
   // Mode switch statement
   switch (E.mode) {
 
+    case VISUAL:
+      switch (c) {
+        case 'h':
+        case 'j':
+        case 'k':
+        case 'l':
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case ARROW_UP:
+        case ARROW_DOWN:
+          editorMoveCursor(c);
+          editorSetStatusMessage("-- VISUAL LINE --");
+          break;
+        case 'y':
+        case 'd':
+        case 'x':
+          editorVisualOperator(c == 'y' ? 'y' : 'd');
+          break;
+        case '!':
+        case ':': {
+          int start, end;
+          editorVisualRange(&start, &end);
+          E.mode = NORMAL;
+          if (c == '!')
+            editorFilterStart(start, end - start + 1);
+          else
+            editorCommand(start, end - start + 1);
+          break;
+        }
+        case 'v':
+        case 'V':
+        case CTRL_KEY('l'):
+        case '\x1b':
+          E.mode = NORMAL;
+          break;
+      }
+      break;
+
     case INSERT:
       switch (c) {
         case '\r':
@@ -946,29 +5803,87 @@ void editorProcessKeypress() {
           E.mode = NORMAL;
           break;
 
+        case CTRL_KEY('n'):
+          editorComplete();
+          break;
+
         default:
-          editorInsertChar(c);
+          // Hotkeys handled above don't belong in the text
+          if (c == '\t' || (c >= ' ' && c < 256 && c != BACKSPACE))
+            editorInsertChar(c);
           break;
       }
       break;
 
     case NORMAL:
+      if ((c >= '1' && c <= '9') || (c == '0' && E.count)) {
+        E.count = E.count * 10 + (c - '0');
+        if (E.count > 1000000000 / 10)
+          E.count = 1000000000 / 10;
+        return;
+      }
+      int counted = E.count > 0;
+      int times = counted ? E.count : 1;
+      E.count = 0;
+
       switch(c) {
         case 'h':
         case 'j':
         case 'k':
         case 'l':
-          editorMoveCursor(c);
+          while (times--) {
+            if (E.csv && (c == 'h' || c == 'l'))
+              editorCsvMoveField(c == 'l' ? 1 : -1);
+            else
+              editorMoveCursor(c);
+          }
+          break;
+        case 'q':
+          if (E.recording)
+            editorMacroStop();
+          else
+            editorMacroRecord();
+          break;
+        case '@':
+          editorMacroPlay(times);
+          break;
+        case '!':
+          // A count filters that many rows from the cursor down
+          if (counted && E.cy < E.numrows)
+            editorFilterStart(E.cy, times < E.numrows - E.cy ?
+                times : E.numrows - E.cy);
+          else
+            editorFilterStart(0, E.numrows);
+          break;
+        case ':':
+          editorCommand(0, E.numrows);
           break;
         case 'i':
           E.mode = INSERT;
           break;
+        case 'z':
+          editorFoldCommand();
+          break;
+        case 'v':
+        case 'V':
+          if (E.numrows) {
+            E.mode = VISUAL;
+            E.vstart = E.cy < E.numrows ? E.cy : E.numrows - 1;
+            editorSetStatusMessage("-- VISUAL LINE --");
+          }
+          break;
+        case 'p':
+        case 'P':
+          while (times--)
+            editorPut(c == 'P');
+          break;
         case CTRL_KEY('q'):
           if(E.dirty && --quit_times) {
             editorSetStatusMessage("Warning: File has been modified. "
                 "Press Ctrl-Q to exit without saving changes.");
             return;
           }
+          editorFilterCancel();
           write(STDOUT_FILENO, "\x1b[2J", 4);
           write(STDOUT_FILENO, "\x1b[H", 3);
           exit(0);
@@ -989,18 +5904,81 @@ void initEditor() {
   E.cy = 0;
   E.rx = 0;
 
+  E.vstart = 0;
+  E.reg.rows = NULL;
+  E.reg.numrows = 0;
+
+  E.count = 0;
+  memset(E.macros, 0, sizeof(E.macros));
+  E.recording = 0;
+  E.last_macro = 0;
+  E.replay_depth = 0;
+
   E.rowoff = 0;
   E.coloff = 0;
 
+  E.folds = NULL;
+  E.numfolds = 0;
+  E.foldcap = 0;
+  E.fold_hidden = NULL;
+
+  E.wrap = 0;
+  E.wrapoff = 0;
+  E.wrap_tree = NULL;
+  E.wrap_treecap = 0;
+  E.wrap_clean = 0;
+
+  E.csv = 0;
+  E.csv_widths = NULL;
+  E.csv_numcols = 0;
+  E.csv_sampled = 0;
+
   E.r_mov = 0;
 
   E.numrows=0;
   E.row = NULL;
+  E.rowcap = 0;
   E.dirty = 0;
 
+  E.file_size = 0;
+  E.file_checked = 0;
+  E.prompting = 0;
+  E.file_changed = 0;
+
+  E.syntax = NULL;
+  E.hl_clean = 0;
+  E.hl_stale_end = 0;
+
+  E.compression = NULL;
+
+  E.stream_fd = -1;
+  E.stream_pid = 0;
+  E.stream_line = NULL;
+  E.stream_linelen = 0;
+  E.stream_linecap = 0;
+  E.stream_drawn = 0;
+
+  E.widx = NULL;
+  E.widx_len = 0;
+  E.widx_cap = 0;
+  E.widx_built = 0;
+  E.comp_row = -1;
+  E.comp_dirty = -1;
+
+  memset(&E.filter, 0, sizeof(E.filter));
+  E.filter.in = -1;
+  E.filter.out = -1;
+
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
 
+  editorInitWidths();
+
+  // Writes to a filter or encoder that exited early fail with EPIPE
+  signal(SIGPIPE, SIG_IGN);
+
+  E.resized = 0;
+  editorInstallWinch();
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
   E.screenrows -= 2;
@@ -1010,14 +5988,23 @@ void initEditor() {
 /* Main */
 
 int main(int argc, char*argv[]) {
+  int stream_fd = -1;
+
+  // "-" reads the buffer from stdin, keys come from the terminal
+  if (argc >= 2 && strcmp(argv[1], "-") == 0)
+    stream_fd = editorReopenTty();
 
   enableRawMode();
   initEditor();
-  if(argc >= 2) {
+  if (stream_fd != -1) {
+    editorOpenStream(stream_fd);
+  }
+  else if(argc >= 2) {
     editorOpen(argv[1]);
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S: Save | Ctrl-Q: Quit | Ctrl-F: Find");
+  editorSetStatusMessage("HELP: Ctrl-S: Save | Ctrl-Q: Quit | Ctrl-F: Find "
+      "| Ctrl-R: Replace | Ctrl-W: Wrap");
 
   while(1) {
     editorRefreshScreen();
@@ -0,0 +1,239 @@
+/* Tests for ceramic, run with `make test`. ceramic.c is included whole so
+ * the tests can reach its internals; its main is renamed out of the way. */
+#define main ceramic_main
+#include "../ceramic.c"
+#undef main
+
+#include <dirent.h>
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+int keys_in = -1;
+
+/* initEditor needs a terminal to size the screen, after that frames go to
+ * /dev/null and keys the editor reads for itself come from a pipe */
+void testSetUp() {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    die("posix_openpt");
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  struct winsize ws = {24, 80, 0, 0};
+  if (slave == -1 || ioctl(slave, TIOCSWINSZ, &ws) == -1)
+    die("pty");
+  dup2(slave, STDOUT_FILENO);
+  initEditor();
+
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  close(slave);
+  close(master);
+
+  int fds[2];
+  if (pipe(fds) == -1)
+    die("pipe");
+  dup2(fds[0], STDIN_FILENO);
+  close(fds[0]);
+  keys_in = fds[1];
+}
+
+void testRows(const char *row, int count) {
+  int i;
+  for (i = 0; i < count; i++)
+    editorInsertRow(E.numrows, (char *) row, strlen(row));
+}
+
+// Types keys the way the main loop handles them, one frame per key
+void testType(const char *keys) {
+  for (; *keys; keys++) {
+    editorRefreshScreen();
+    editorProcessKey((unsigned char) *keys);
+  }
+}
+
+// Queues keys for the editor to read itself, like the register after @
+void testPending(const char *keys) {
+  if (write(keys_in, keys, strlen(keys)) != (ssize_t) strlen(keys))
+    die("write");
+}
+
+// Fills register c as if the keys had been recorded into it
+void testMacro(int c, const char *keys) {
+  struct editorMacro *m = &E.macros[c - 'a'];
+  m->length = m->cap = strlen(keys);
+  m->keys = malloc(sizeof(int) * m->cap);
+  int i;
+  for (i = 0; i < m->length; i++)
+    m->keys[i] = (unsigned char) keys[i];
+}
+
+int testRowIs(int at, const char *s) {
+  return at < E.numrows && E.row[at].size == (int) strlen(s) &&
+      memcmp(E.row[at].chars, s, E.row[at].size) == 0;
+}
+
+void testCheckWrapTree() {
+  editorWrapEnsure();
+  int i, sum = 0;
+  for (i = 0; i <= E.numrows; i++) {
+    CHECK(editorWrapPrefix(i) == sum);
+    if (i < E.numrows) {
+      CHECK(E.row[i].wraplines == editorWrapLines(i));
+      sum += E.row[i].wraplines;
+    }
+  }
+}
+
+/* Tests */
+
+// Rows added after the wrap index was built, then an edit above them
+void testWrapAppendThenEdit() {
+  testRows("0123456789", 10);
+  E.screencols = 8;
+  editorWrapInvalidate(0);
+  editorToggleWrap();
+  editorRefreshScreen();
+
+  testRows("x", 40);
+  int i;
+  for (i = 0; i < 20; i++)
+    editorRowInsertChar(&E.row[0], 0, 'y');
+  testCheckWrapTree();
+}
+
+// Vertical motion after a horizontal one, typed and then replayed
+void testMacroVerticalMotion() {
+  testRows("0123456789", 4);
+  testType("llljiX\x1b");
+  CHECK(testRowIs(1, "012X3456789"));
+
+  E.cy = 2;
+  E.cx = 0;
+  E.r_mov = 1;
+  testMacro('a', "llljiX\x1b");
+  testPending("a");
+  testType("@");
+  CHECK(testRowIs(3, "012X3456789"));
+}
+
+// A sort that closes a comment has to recolour the row below the range
+void testSortRelexesBelow() {
+  E.filename = strdup("h.c");
+  editorSelectSyntaxHighlight();
+  testRows("b /* */", 1);
+  testRows("a /*", 1);
+  testRows("x */", 1);
+  editorSyntaxUpdate(E.numrows - 1, 0, E.numrows);
+  CHECK(E.row[2].hl[0] == HL_MLCOMMENT);
+
+  struct editorSortOptions opts;
+  memset(&opts, 0, sizeof(opts));
+  editorSortRows(0, 2, &opts, 1);
+  CHECK(testRowIs(0, "a /*"));
+  editorSyntaxUpdate(E.numrows - 1, 0, E.numrows);
+  CHECK(E.row[2].hl[0] != HL_MLCOMMENT);
+}
+
+// A prompt holds reloads off, the command after it has picked its rows
+void testNoReloadWhilePrompting() {
+  char path[] = "/tmp/ceramic-test-XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1 && write(fd, "a\nb\nc\n", 6) == 6);
+  editorOpen(path);
+  CHECK(E.numrows == 3);
+
+  CHECK(ftruncate(fd, 2) == 0);
+  close(fd);
+  E.prompting = 1;
+  E.file_checked = 0;
+  editorCheckFileChange();
+  CHECK(E.numrows == 3);
+
+  E.prompting = 0;
+  E.file_checked = 0;
+  editorCheckFileChange();
+  CHECK(E.numrows == 1);
+  unlink(path);
+}
+
+// A canceled filter that ignores SIGTERM still goes, and is reaped
+void testKillChildIgnoringTerm() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    signal(SIGTERM, SIG_IGN);
+    for (;;)
+      pause();
+  }
+  CHECK(pid != -1);
+  editorKillChild(pid);
+  CHECK(waitpid(pid, NULL, WNOHANG) == -1 && errno == ECHILD);
+}
+
+// A leftover temp file doesn't block a compressed save, none is left
+void testCompressedSaveLeavesNoTemp() {
+  char dir[] = "/tmp/ceramic-test-XXXXXX";
+  CHECK(mkdtemp(dir) != NULL);
+  char path[64], stale[64];
+  snprintf(path, sizeof(path), "%s/f.gz", dir);
+  snprintf(stale, sizeof(stale), "%s/f.gz.tmp", dir);
+  close(open(stale, O_WRONLY | O_CREAT, 0644));
+
+  E.filename = strdup(path);
+  E.compression = &CDB[0];
+  testRows("a", 1);
+  testPending("y");
+  editorSave();
+  CHECK(E.dirty == 0);
+
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  int entries = 0;
+  while ((ent = readdir(d)) != NULL)
+    entries += ent->d_name[0] != '.';
+  closedir(d);
+  CHECK(entries == 2);
+  unlink(stale);
+  unlink(path);
+  rmdir(dir);
+}
+
+struct test {
+  const char *name;
+  void (*fn)();
+};
+
+struct test TESTS[] = {
+  {"wrap append then edit", testWrapAppendThenEdit},
+  {"macro vertical motion", testMacroVerticalMotion},
+  {"sort relexes below", testSortRelexesBelow},
+  {"no reload while prompting", testNoReloadWhilePrompting},
+  {"kill child ignoring term", testKillChildIgnoringTerm},
+  {"compressed save leaves no temp", testCompressedSaveLeavesNoTemp},
+};
+
+#define TESTS_ENTRIES (sizeof(TESTS) / sizeof(TESTS[0]))
+
+// Every test runs in its own process, on a fresh editor
+int main() {
+  unsigned int i;
+  int failed = 0;
+  for (i = 0; i < TESTS_ENTRIES; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      testSetUp();
+      TESTS[i].fn();
+      exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    fprintf(stderr, "%s: %s\n", ok ? "ok" : "FAIL", TESTS[i].name);
+    failed += !ok;
+  }
+  return failed != 0;
+}